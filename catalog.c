@@ -0,0 +1,709 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* The path catalog is an optional sidecar file, <image>.cat, holding
+   every path in the image with where its directory entry is, its
+   start cluster, size and extents, in hash tables that are used
+   straight from a read-only mapping.  With a good catalog, finding a
+   file is one probe, however deep it is, and needs no directory to be
+   read.
+
+   A catalog is only used if it still describes the image.  Checking
+   that has to be cheap, or it costs more than the lookups it saves,
+   so its stamp is a hash of the FAT together with the image file's
+   identity, size and modification time, which the kernel bumps on
+   every write to it, whoever makes it.  Anything written to the
+   volume through these tools stops the catalog being used, and when
+   the volume is synced or closed the catalog is rebuilt (and
+   restamped), reusing what it had for every directory whose clusters
+   hash the same as they did.
+
+   dos_catalog creates one; after that, the tools keep it up to date.
+   Paths are stored as the sequence of their components' directory
+   keys (see dirindex.c), so "img/rangeley.jpg" is "IMG        " +
+   "RANGELEYJPG". */
+
+#define CAT_MAGIC    "FATCAT2"
+#define CAT_MAXDEPTH 64
+
+struct cat_header {
+    char magic[8];
+    uint64_t stamp;             /* the hash of the FAT */
+    uint64_t image_ino, image_size, image_mtime; /* mtime in nanoseconds */
+    uint32_t size;              /* of the whole file */
+    uint32_t ndirs, nentries, nbuckets, nextents, nkeybytes;
+    uint32_t dirs_off, paths_off, clusters_off, entries_off;
+    uint32_t extents_off, keys_off;
+};
+
+/* a directory, and the range of entries for its contents */
+struct cat_dir {
+    uint64_t hash;
+    uint16_t cluster;           /* first cluster, MSDOSFSROOT for the root */
+    uint16_t pad;
+    uint32_t first_child;
+    uint32_t nchildren;
+    uint32_t pad2;
+};
+
+struct cat_entry {
+    uint32_t hash;              /* of the path's keys */
+    uint32_t key_off;           /* the path's keys, depth * DIRKEY_LEN bytes */
+    uint16_t depth;
+    uint16_t start_cluster;
+    uint32_t dirent_off;        /* of the directory entry in the image */
+    uint32_t size;
+    uint32_t ext_first;
+    uint32_t nextents;
+    uint8_t attributes;
+    uint8_t pad[3];
+};
+
+/* the path and start cluster tables hold entry numbers + 1, 0 for an
+   empty bucket */
+#define CAT_ARRAY(cat, off, type) \
+    ((type *)((uint8_t *)(cat) + (cat)->off))
+
+
+/* hash64 mixes len bytes into h, a word at a time */
+uint64_t hash64(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    uint64_t w;
+
+    for ( ; len >= 8; len -= 8, p += 8)
+    {
+	memcpy(&w, p, 8);
+	h = (h ^ w) * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 29;
+    }
+    if (len > 0)
+    {
+	w = 0;
+	memcpy(&w, p, len);
+	h = (h ^ w ^ ((uint64_t)len << 56)) * 0x9e3779b97f4a7c15ULL;
+	h ^= h >> 29;
+    }
+    return h;
+}
+
+static uint32_t path_hash(const uint8_t *keys, int depth)
+{
+    uint64_t h = hash64(depth, keys, depth * DIRKEY_LEN);
+    return (uint32_t)(h ^ (h >> 32));
+}
+
+static uint32_t cluster_hash(uint16_t cluster)
+{
+    return cluster * 2654435761u;
+}
+
+
+/* dir_hash hashes the clusters of the directory at cluster dir, and
+   what's in them, so a rebuild can tell which directories it can
+   reuse */
+static uint64_t dir_hash(uint16_t dir, struct fat_volume *vol)
+{
+    uint64_t h = dir;
+    uint16_t cluster = dir;
+    uint32_t budget = vol->max_cluster;
+
+    if (dir == MSDOSFSROOT)
+	return hash64(h, root_dir_addr(vol),
+		      vol->bpb->bpbRootDirEnts * sizeof(struct direntry));
+
+    while (is_valid_cluster(cluster, vol) && cluster < vol->nclusters &&
+	   budget-- > 0)
+    {
+	h = hash64(h, &cluster, sizeof(cluster));
+	h = hash64(h, cluster_to_addr(cluster, vol), vol->bytes_per_cluster);
+	cluster = get_fat_entry(cluster, vol);
+    }
+    return h;
+}
+
+
+static uint64_t catalog_stamp(struct fat_volume *vol)
+{
+    return hash64(0, vol->fat, vol->fat_nentries * sizeof(uint16_t));
+}
+
+/* image_identity gets what the catalog's stamp holds about the image
+   file itself */
+static int image_identity(struct fat_volume *vol, struct cat_header *hdr)
+{
+    struct stat st;
+
+    if (fstat(vol->fd, &st) < 0)
+	return -1;
+    hdr->image_ino = st.st_ino;
+    hdr->image_size = st.st_size;
+    hdr->image_mtime = st.st_mtim.tv_sec * 1000000000ULL + st.st_mtim.tv_nsec;
+    return 0;
+}
+
+
+/* catalog_fits checks that the tables in a catalog all lie within it.
+   What's in them is checked as it's used (see cat_entry_at), so a
+   damaged catalog can't send lookups off the end of the mapping. */
+static int catalog_fits(struct cat_header *cat, size_t size)
+{
+    if (memcmp(cat->magic, CAT_MAGIC, 8) != 0 || cat->size != size ||
+	cat->nbuckets == 0 || (cat->nbuckets & (cat->nbuckets - 1)) != 0 ||
+	cat->nbuckets <= cat->nentries)
+	return FALSE;
+    return (uint64_t)cat->dirs_off + cat->ndirs * sizeof(struct cat_dir) <= size
+	&& (uint64_t)cat->paths_off + cat->nbuckets * sizeof(uint32_t) <= size
+	&& (uint64_t)cat->clusters_off + cat->nbuckets * sizeof(uint32_t) <= size
+	&& (uint64_t)cat->entries_off
+	   + cat->nentries * sizeof(struct cat_entry) <= size
+	&& (uint64_t)cat->extents_off
+	   + cat->nextents * sizeof(struct extent) <= size
+	&& (uint64_t)cat->keys_off + cat->nkeybytes <= size;
+}
+
+
+/* catalog_open maps the catalog for the image called filename, if
+   there is one, and checks that it's up to date.  One that isn't is
+   rebuilt when the volume is synced or closed. */
+void catalog_open(char *filename, struct fat_volume *vol)
+{
+    struct cat_header *cat, now;
+    struct stat st;
+    int fd;
+
+    vol->catalog_path = malloc(strlen(filename) + 5);
+    sprintf(vol->catalog_path, "%s.cat", filename);
+
+    /* no catalog for this image - and none wanted, unless dos_catalog
+       makes one */
+    fd = open(vol->catalog_path, O_RDONLY);
+    if (fd < 0)
+	return;
+    if (fstat(fd, &st) < 0 || st.st_size < sizeof(struct cat_header))
+    {
+	close(fd);
+	return;
+    }
+    cat = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cat == MAP_FAILED)
+	return;
+
+    vol->catalog = cat;
+    vol->catalog_size = st.st_size;
+    vol->modified = TRUE;
+    if (!catalog_fits(cat, st.st_size))
+	return;
+
+    /* it's only any use if nothing has changed since it was made */
+    if (image_identity(vol, &now) < 0 || now.image_ino != cat->image_ino ||
+	now.image_size != cat->image_size ||
+	now.image_mtime != cat->image_mtime ||
+	catalog_stamp(vol) != cat->stamp)
+	return;
+    vol->catalog_ok = TRUE;
+    vol->modified = FALSE;
+}
+
+
+void catalog_close(struct fat_volume *vol)
+{
+    if (vol->catalog != NULL)
+	munmap(vol->catalog, vol->catalog_size);
+    free(vol->catalog_path);
+    vol->catalog = NULL;
+    vol->catalog_path = NULL;
+    vol->catalog_ok = FALSE;
+}
+
+
+/* cat_entry_at gives the entry a bucket holds, or NULL if it's empty,
+   or holds an entry whose keys or extents aren't in their tables */
+static struct cat_entry *cat_entry_at(struct cat_header *cat, uint32_t e)
+{
+    struct cat_entry *entry;
+
+    if (e == 0 || e > cat->nentries)
+	return NULL;
+    entry = CAT_ARRAY(cat, entries_off, struct cat_entry) + e - 1;
+    if (entry->depth == 0 ||
+	(uint64_t)entry->key_off + entry->depth * DIRKEY_LEN > cat->nkeybytes ||
+	(uint64_t)entry->ext_first + entry->nextents > cat->nextents)
+	return NULL;
+    return entry;
+}
+
+/* find_entry looks a path up in the path table.  The table always has
+   an empty bucket to stop at, but a damaged one might not, so it
+   gives up after looking at every bucket once. */
+static struct cat_entry *find_entry(struct cat_header *cat,
+				    const uint8_t *keys, int depth)
+{
+    uint32_t *paths = CAT_ARRAY(cat, paths_off, uint32_t);
+    uint8_t *keybytes = CAT_ARRAY(cat, keys_off, uint8_t);
+    uint32_t h = path_hash(keys, depth), b, e;
+    struct cat_entry *entry;
+
+    for (b = h; b - h < cat->nbuckets; b++)
+    {
+	e = paths[b & (cat->nbuckets - 1)];
+	if (e == 0)
+	    return NULL;
+	entry = cat_entry_at(cat, e);
+	if (entry == NULL)
+	    return NULL;
+	if (entry->hash == h && entry->depth == depth &&
+	    memcmp(keybytes + entry->key_off, keys, depth * DIRKEY_LEN) == 0)
+	    return entry;
+    }
+    return NULL;
+}
+
+
+/* catalog_lookup answers a lookup_path from the root with the
+   catalog, if there's an up to date one.  Returns FALSE if it can't,
+   and the lookup has to be done the slow way. */
+int catalog_lookup(const char *path, struct direntry **result,
+		   int32_t *parent, struct fat_volume *vol)
+{
+    uint8_t keys[CAT_MAXDEPTH * DIRKEY_LEN], key[DIRKEY_LEN];
+    struct cat_entry *entry;
+    const char *end;
+    int depth = 0, bad = -1;
+
+    if (!vol->catalog_ok)
+	return FALSE;
+
+    /* encode the path, noting the first component that can't be a
+       name at all */
+    while (1)
+    {
+	while (*path == '/' || *path == '\\')
+	    path++;
+	if (*path == '\0')
+	    break;
+	if (depth == CAT_MAXDEPTH)
+	    return FALSE;
+	end = path + strcspn(path, "/\\");
+	if (!make_dir_key(path, end - path, keys + depth * DIRKEY_LEN) &&
+	    bad < 0)
+	    bad = depth;
+	depth++;
+	path = end;
+    }
+
+    *result = NULL;
+    if (depth > 0 && bad < 0)
+    {
+	entry = find_entry(vol->catalog, keys, depth);
+	if (entry != NULL && entry->dirent_off + sizeof(struct direntry) <= vol->size)
+	{
+	    *result = (struct direntry *)(vol->image_buf + entry->dirent_off);
+	    dirent_key(*result, key);
+	    if (memcmp(key, keys + (depth - 1) * DIRKEY_LEN, DIRKEY_LEN) != 0)
+		return FALSE;
+	}
+    }
+
+    if (parent == NULL)
+	return TRUE;
+    if (depth <= 1)
+	*parent = MSDOSFSROOT;
+    else if (bad >= 0 && bad < depth - 1)
+	*parent = -1;
+    else
+    {
+	entry = find_entry(vol->catalog, keys, depth - 1);
+	if (entry != NULL && (entry->attributes & ATTR_DIRECTORY) != 0)
+	    *parent = entry->start_cluster;
+	else
+	    *parent = -1;
+    }
+    return TRUE;
+}
+
+
+/* catalog_extents gives the extents of the file starting at cluster,
+   if the catalog knows them.  Returns -1 if it doesn't. */
+int catalog_extents(uint16_t cluster, struct extent **extents,
+		    struct fat_volume *vol)
+{
+    struct cat_header *cat = vol->catalog;
+    struct cat_entry *entry = NULL;
+    uint32_t *clusters, h, b;
+
+    if (!vol->catalog_ok)
+	return -1;
+
+    clusters = CAT_ARRAY(cat, clusters_off, uint32_t);
+    h = cluster_hash(cluster);
+    for (b = h; b - h < cat->nbuckets; b++)
+    {
+	entry = cat_entry_at(cat, clusters[b & (cat->nbuckets - 1)]);
+	if (entry == NULL || entry->start_cluster == cluster)
+	    break;
+    }
+    if (entry == NULL || entry->start_cluster != cluster)
+	return -1;
+
+    *extents = NULL;
+    if (entry->nextents > 0)
+    {
+	*extents = malloc(entry->nextents * sizeof(struct extent));
+	memcpy(*extents, CAT_ARRAY(cat, extents_off, struct extent)
+	       + entry->ext_first,
+	       entry->nextents * sizeof(struct extent));
+    }
+    return entry->nextents;
+}
+
+
+/* a catalog under construction */
+struct cat_build {
+    struct cat_dir *dirs;
+    struct cat_entry *entries;
+    struct extent *extents;
+    uint8_t *keys;
+    uint32_t ndirs, nentries, nextents, nkeybytes;
+    uint32_t dirs_max, entries_max, extents_max, keys_max;
+};
+
+/* grow makes room in a growing array for n more items */
+static void *grow(void *array, uint32_t *max, uint32_t used, uint32_t n,
+		  size_t size)
+{
+    if (used + n <= *max)
+	return array;
+    while (used + n > *max)
+	*max = *max ? *max * 2 : 64;
+    return realloc(array, *max * size);
+}
+
+
+/* add_entry adds the entry for dirent, at the end of the path whose
+   keys start at parent_key, to the catalog */
+static struct cat_entry *add_entry(struct cat_build *b, uint32_t parent_key,
+				   int depth, const uint8_t *key,
+				   uint32_t dirent_off, struct direntry *dirent,
+				   struct fat_volume *vol)
+{
+    struct cat_entry *entry;
+    struct extent *ext;
+    int n;
+
+    b->keys = grow(b->keys, &b->keys_max, b->nkeybytes,
+		   depth * DIRKEY_LEN, 1);
+    memmove(b->keys + b->nkeybytes, b->keys + parent_key,
+	    (depth - 1) * DIRKEY_LEN);
+    memcpy(b->keys + b->nkeybytes + (depth - 1) * DIRKEY_LEN, key, DIRKEY_LEN);
+
+    b->entries = grow(b->entries, &b->entries_max, b->nentries, 1,
+		      sizeof(struct cat_entry));
+    entry = &b->entries[b->nentries++];
+    memset(entry, 0, sizeof(*entry));
+    entry->key_off = b->nkeybytes;
+    entry->depth = depth;
+    entry->hash = path_hash(b->keys + b->nkeybytes, depth);
+    entry->dirent_off = dirent_off;
+    entry->start_cluster = getushort(dirent->deStartCluster);
+    entry->size = getulong(dirent->deFileSize);
+    entry->attributes = dirent->deAttributes;
+    b->nkeybytes += depth * DIRKEY_LEN;
+
+    n = chain_extents(entry->start_cluster, &ext, vol);
+    b->extents = grow(b->extents, &b->extents_max, b->nextents, n,
+		      sizeof(struct extent));
+    if (n > 0)
+	memcpy(b->extents + b->nextents, ext, n * sizeof(struct extent));
+    entry->ext_first = b->nextents;
+    entry->nextents = n;
+    b->nextents += n;
+    free(ext);
+    return entry;
+}
+
+
+/* scan_children adds the entries of the directory at cluster dir,
+   which begin at its first block, block */
+static void scan_children(struct cat_build *b, uint16_t dir,
+			  uint32_t parent_key, int depth,
+			  struct fat_volume *vol)
+{
+    struct direntry *block;
+    uint16_t cluster = dir;
+    uint32_t budget = vol->max_cluster;
+    uint8_t key[DIRKEY_LEN];
+    int i, nentries;
+
+    while (1)
+    {
+	if (dir == MSDOSFSROOT)
+	{
+	    block = (struct direntry *)root_dir_addr(vol);
+	    nentries = vol->bpb->bpbRootDirEnts;
+	}
+	else
+	{
+	    if (!is_valid_cluster(cluster, vol) || cluster >= vol->nclusters ||
+		budget-- == 0)
+		return;
+	    block = (struct direntry *)cluster_to_addr(cluster, vol);
+	    nentries = vol->bytes_per_cluster / sizeof(struct direntry);
+	}
+
+	for (i = 0; i < nentries; i++)
+	{
+	    if (block[i].deName[0] == SLOT_EMPTY)
+		return;
+	    if (!is_named(&block[i]))
+		continue;
+	    dirent_key(&block[i], key);
+	    add_entry(b, parent_key, depth, key,
+		      (uint8_t *)&block[i] - vol->image_buf, &block[i], vol);
+	}
+
+	if (dir == MSDOSFSROOT)
+	    return;
+	cluster = get_fat_entry(cluster, vol);
+    }
+}
+
+
+/* build_catalog makes a catalog of everything in the volume, taking
+   the contents of unchanged directories from old, if there is one */
+static void build_catalog(struct cat_build *b, struct cat_header *old,
+			  struct fat_volume *vol)
+{
+    struct stackent {
+	uint16_t cluster;
+	uint16_t depth;
+	uint32_t key_off;       /* of the directory's own path */
+    } *stack;
+    int32_t *old_dir = NULL;
+    uint64_t visited[FREEMAP_WORDS];
+    struct cat_dir *od, *nd;
+    struct cat_entry *oe, *e;
+    uint8_t *okeys;
+    uint32_t i, first, sp = 0;
+    struct stackent top;
+
+    /* where each directory is in the old catalog */
+    if (old != NULL)
+    {
+	old_dir = malloc(FAT_NENTRIES * sizeof(int32_t));
+	memset(old_dir, 0xff, FAT_NENTRIES * sizeof(int32_t));
+	for (i = 0; i < old->ndirs; i++)
+	{
+	    od = CAT_ARRAY(old, dirs_off, struct cat_dir) + i;
+	    if (od->cluster < FAT_NENTRIES)
+		old_dir[od->cluster] = i;
+	}
+    }
+
+    memset(visited, 0, sizeof(visited));
+    stack = malloc(FAT_NENTRIES * sizeof(struct stackent));
+    stack[sp].cluster = MSDOSFSROOT;
+    stack[sp].depth = 0;
+    stack[sp].key_off = 0;
+    sp++;
+
+    while (sp > 0)
+    {
+	top = stack[--sp];
+
+	/* a directory that's already been done is a loop (or a
+	   cross-link) in a damaged image */
+	if (visited[top.cluster / 64] & (1ULL << (top.cluster % 64)))
+	    continue;
+	visited[top.cluster / 64] |= 1ULL << (top.cluster % 64);
+
+	b->dirs = grow(b->dirs, &b->dirs_max, b->ndirs, 1,
+		       sizeof(struct cat_dir));
+	nd = &b->dirs[b->ndirs++];
+	memset(nd, 0, sizeof(*nd));
+	nd->cluster = top.cluster;
+	nd->hash = dir_hash(top.cluster, vol);
+	first = b->nentries;
+
+	od = NULL;
+	if (old_dir != NULL && old_dir[top.cluster] >= 0)
+	    od = CAT_ARRAY(old, dirs_off, struct cat_dir) + old_dir[top.cluster];
+
+	if (od != NULL && od->hash == nd->hash &&
+	    (uint64_t)od->first_child + od->nchildren <= old->nentries)
+	{
+	    /* unchanged, so its entries are still right - only the
+	       path leading to it might be different */
+	    okeys = CAT_ARRAY(old, keys_off, uint8_t);
+	    for (i = 0; i < od->nchildren; i++)
+	    {
+		oe = cat_entry_at(old, od->first_child + i + 1);
+		if (oe != NULL &&
+		    oe->dirent_off + sizeof(struct direntry) <= vol->size)
+		    add_entry(b, top.key_off, top.depth + 1,
+			      okeys + oe->key_off + (oe->depth - 1) * DIRKEY_LEN,
+			      oe->dirent_off,
+			      (struct direntry *)(vol->image_buf + oe->dirent_off),
+			      vol);
+	    }
+	}
+	else
+	    scan_children(b, top.cluster, top.key_off, top.depth + 1, vol);
+
+	/* growing the entries may have moved the directories */
+	nd = &b->dirs[b->ndirs - 1];
+	nd->first_child = first;
+	nd->nchildren = b->nentries - first;
+
+	for (i = first; i < b->nentries; i++)
+	{
+	    e = &b->entries[i];
+	    if ((e->attributes & ATTR_DIRECTORY) != 0 &&
+		is_valid_cluster(e->start_cluster, vol) && sp < FAT_NENTRIES)
+	    {
+		stack[sp].cluster = e->start_cluster;
+		stack[sp].depth = e->depth;
+		stack[sp].key_off = e->key_off;
+		sp++;
+	    }
+	}
+    }
+
+    free(stack);
+    free(old_dir);
+}
+
+
+/* catalog_write brings the volume's catalog file up to date, and
+   starts using the new one */
+int catalog_write(struct fat_volume *vol)
+{
+    struct cat_build b;
+    struct cat_header hdr;
+    uint32_t *paths, *clusters, i, j, off;
+    char *tmpname;
+    uint8_t *buf;
+    int fd, ok;
+
+    memset(&b, 0, sizeof(b));
+    build_catalog(&b, vol->catalog != NULL &&
+		  catalog_fits(vol->catalog, vol->catalog_size) ?
+		  vol->catalog : NULL, vol);
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, CAT_MAGIC, 8);
+    hdr.stamp = catalog_stamp(vol);
+    image_identity(vol, &hdr);
+    hdr.ndirs = b.ndirs;
+    hdr.nentries = b.nentries;
+    hdr.nextents = b.nextents;
+    hdr.nkeybytes = b.nkeybytes;
+
+    /* keep the tables at most half full */
+    hdr.nbuckets = 16;
+    while (hdr.nbuckets < 2 * b.nentries)
+	hdr.nbuckets *= 2;
+
+#define PLACE(field, bytes) \
+    do { hdr.field = off; off = (off + (bytes) + 7) & ~7; } while (0)
+    off = (sizeof(hdr) + 7) & ~7;
+    PLACE(dirs_off, b.ndirs * sizeof(struct cat_dir));
+    PLACE(paths_off, hdr.nbuckets * sizeof(uint32_t));
+    PLACE(clusters_off, hdr.nbuckets * sizeof(uint32_t));
+    PLACE(entries_off, b.nentries * sizeof(struct cat_entry));
+    PLACE(extents_off, b.nextents * sizeof(struct extent));
+    PLACE(keys_off, b.nkeybytes);
+#undef PLACE
+    hdr.size = off;
+
+    buf = calloc(1, hdr.size);
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + hdr.dirs_off, b.dirs, b.ndirs * sizeof(struct cat_dir));
+    memcpy(buf + hdr.entries_off, b.entries,
+	   b.nentries * sizeof(struct cat_entry));
+    memcpy(buf + hdr.extents_off, b.extents,
+	   b.nextents * sizeof(struct extent));
+    memcpy(buf + hdr.keys_off, b.keys, b.nkeybytes);
+
+    /* first one wins, in both tables, as it would in a directory scan */
+    paths = (uint32_t *)(buf + hdr.paths_off);
+    clusters = (uint32_t *)(buf + hdr.clusters_off);
+    for (i = 0; i < b.nentries; i++)
+    {
+	for (j = b.entries[i].hash; paths[j & (hdr.nbuckets - 1)] != 0; j++)
+	    ;
+	paths[j & (hdr.nbuckets - 1)] = i + 1;
+
+	if (b.entries[i].nextents == 0)
+	    continue;
+	for (j = cluster_hash(b.entries[i].start_cluster); ; j++)
+	{
+	    uint32_t e = clusters[j & (hdr.nbuckets - 1)];
+	    if (e == 0)
+	    {
+		clusters[j & (hdr.nbuckets - 1)] = i + 1;
+		break;
+	    }
+	    if (b.entries[e - 1].start_cluster == b.entries[i].start_cluster)
+		break;
+	}
+    }
+
+    free(b.dirs);
+    free(b.entries);
+    free(b.extents);
+    free(b.keys);
+
+    /* write it alongside, then swap it in, so a reader never sees
+       half a catalog */
+    tmpname = malloc(strlen(vol->catalog_path) + 16);
+    sprintf(tmpname, "%s.%d", vol->catalog_path, (int)getpid());
+    fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    ok = fd >= 0 && write(fd, buf, hdr.size) == hdr.size;
+    if (fd >= 0)
+	close(fd);
+    ok = ok && rename(tmpname, vol->catalog_path) == 0;
+    if (!ok)
+    {
+	fprintf(stderr, "Can't write catalog %s: %s\n", vol->catalog_path,
+		strerror(errno));
+	unlink(tmpname);
+    }
+    free(tmpname);
+    free(buf);
+    if (!ok)
+	return -1;
+
+    /* and use the new one from now on */
+    if (vol->catalog != NULL)
+	munmap(vol->catalog, vol->catalog_size);
+    vol->catalog = NULL;
+    vol->catalog_ok = FALSE;
+    fd = open(vol->catalog_path, O_RDONLY);
+    if (fd >= 0)
+    {
+	vol->catalog = mmap(NULL, hdr.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (vol->catalog == MAP_FAILED)
+	    vol->catalog = NULL;
+	vol->catalog_size = hdr.size;
+	vol->catalog_ok = vol->catalog != NULL;
+	close(fd);
+    }
+    vol->modified = FALSE;
+    return 0;
+}
@@ -0,0 +1,422 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <emmintrin.h>
+#define HAVE_SSE2_SCAN 1
+#endif
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* Looking a name up in a directory means comparing it against every
+   entry, cluster after cluster.  Instead, names are looked up by
+   their key: the 11 bytes of the on-disk 8.3 name, space padded and
+   folded to upper case, which is what's in the directory entry
+   anyway.  The first lookup in a directory just scans it.  If it's
+   looked in again, a hash table of its entries' keys is built, and
+   kept on the volume until something writes to the directory or
+   changes its cluster chain.
+
+   Lookups may run at the same time as each other (an index being
+   built is only published once complete), but not at the same time
+   as anything that modifies the volume. */
+
+struct dir_slot {
+    uint8_t key[DIRKEY_LEN];
+    struct direntry *dirent;    /* NULL if the slot is free */
+};
+
+struct dir_index {
+    uint32_t mask;              /* number of slots - 1 */
+    struct dir_slot slots[];
+};
+
+
+/* make_dir_key encodes the len bytes of name ("readme.txt") as a
+   directory key ("README  TXT").  Returns FALSE if it can't be an 8.3
+   name, in which case nothing can match it. */
+int make_dir_key(const char *name, size_t len, uint8_t *key)
+{
+    const char *dot = NULL;
+    size_t i, baselen, extlen;
+
+    for (i = 0; i < len; i++)
+	if (name[i] == '.')
+	    dot = name + i;
+
+    baselen = dot ? dot - name : len;
+    extlen = dot ? len - baselen - 1 : 0;
+    if (baselen == 0 || baselen > 8 || extlen > 3)
+	return FALSE;
+
+    memset(key, ' ', DIRKEY_LEN);
+    for (i = 0; i < baselen; i++)
+	key[i] = toupper((uint8_t)name[i]);
+    for (i = 0; i < extlen; i++)
+	key[8 + i] = toupper((uint8_t)dot[1 + i]);
+    return TRUE;
+}
+
+
+/* dirent_key is the key for an existing directory entry */
+void dirent_key(struct direntry *dirent, uint8_t *key)
+{
+    const uint8_t *name = (const uint8_t *)dirent;
+    int i;
+
+    /* deName and deExtension are adjacent, at the start of the entry */
+    for (i = 0; i < DIRKEY_LEN; i++)
+	key[i] = toupper(name[i]);
+    if (key[0] == SLOT_E5)
+	key[0] = SLOT_DELETED;
+}
+
+
+/* is this an entry that lookups can find? */
+int is_named(struct direntry *dirent)
+{
+    return dirent->deName[0] != SLOT_DELETED
+	&& dirent->deName[0] != '.'
+	&& (dirent->deAttributes & ATTR_WIN95LFN) != ATTR_WIN95LFN
+	&& (dirent->deAttributes & ATTR_VOLUME) == 0;
+}
+
+
+static uint32_t key_hash(const uint8_t *key)
+{
+    uint32_t h = 2166136261u;   /* FNV-1a */
+    int i;
+
+    for (i = 0; i < DIRKEY_LEN; i++)
+	h = (h ^ key[i]) * 16777619u;
+    return h;
+}
+
+
+/* dir_block returns the n'th block of a directory - the root
+   directory is one block, and a subdirectory has one per cluster -
+   and the number of entries in it, or NULL after the last one.
+   *cluster carries the walk from one block to the next. */
+static struct direntry *dir_block(uint16_t dir, uint16_t *cluster, int n,
+				  int *nentries, struct fat_volume *vol)
+{
+    if (dir == MSDOSFSROOT)
+    {
+	if (n > 0)
+	    return NULL;
+	*nentries = vol->bpb->bpbRootDirEnts;
+	STAT_ADD(dirents, *nentries);
+	return (struct direntry *)root_dir_addr(vol);
+    }
+
+    *cluster = n == 0 ? dir : get_fat_entry(*cluster, vol);
+
+    /* the budget stops a chain that loops back on itself */
+    if (!is_valid_cluster(*cluster, vol) || *cluster >= vol->nclusters ||
+	n >= vol->max_cluster)
+	return NULL;
+    *nentries = vol->bytes_per_cluster / sizeof(struct direntry);
+    STAT_ADD(dirents, *nentries);
+    return (struct direntry *)cluster_to_addr(*cluster, vol);
+}
+
+
+/* find_in_block returns the index of the first entry among the
+   nentries in block that is called key, or of the first empty slot
+   (which ends the directory), whichever comes first - or nentries if
+   there's neither. */
+
+#ifdef HAVE_SSE2_SCAN
+
+/* This compares each entry's whole name at once rather than a byte at
+   a time: the first 16 bytes of the entry - the name, extension and
+   attributes - are loaded, folded to upper case and compared with the
+   key in one go.  Only a matching name gets the slower checks for
+   deleted, long name and volume label slots. */
+static int find_in_block(struct direntry *block, int nentries,
+			 const uint8_t *key)
+{
+    uint8_t raw[16];
+    __m128i want, below_a, above_z, v, lower;
+    int i;
+
+    /* the key as it is on disk: a name really starting with 0xe5 is
+       stored as 0x05 */
+    memset(raw, 0, sizeof(raw));
+    memcpy(raw, key, DIRKEY_LEN);
+    if (raw[0] == SLOT_DELETED)
+	raw[0] = SLOT_E5;
+    want = _mm_loadu_si128((const __m128i *)raw);
+    below_a = _mm_set1_epi8('a' - 1);
+    above_z = _mm_set1_epi8('z' + 1);
+
+    for (i = 0; i < nentries; i++)
+    {
+	if (block[i].deName[0] == SLOT_EMPTY)
+	    return i;
+	v = _mm_loadu_si128((const __m128i *)&block[i]);
+
+	/* bytes over 0x7f are negative, so never look like 'a'-'z' */
+	lower = _mm_and_si128(_mm_cmpgt_epi8(v, below_a),
+			      _mm_cmplt_epi8(v, above_z));
+	v = _mm_sub_epi8(v, _mm_and_si128(lower, _mm_set1_epi8(0x20)));
+	if ((_mm_movemask_epi8(_mm_cmpeq_epi8(v, want)) & 0x7ff) == 0x7ff &&
+	    is_named(&block[i]))
+	    return i;
+    }
+    return nentries;
+}
+
+#else
+
+static int find_in_block(struct direntry *block, int nentries,
+			 const uint8_t *key)
+{
+    uint8_t k[DIRKEY_LEN];
+    int i;
+
+    for (i = 0; i < nentries; i++)
+    {
+	if (block[i].deName[0] == SLOT_EMPTY)
+	    return i;
+	if (!is_named(&block[i]))
+	    continue;
+	dirent_key(&block[i], k);
+	if (memcmp(k, key, DIRKEY_LEN) == 0)
+	    return i;
+    }
+    return nentries;
+}
+
+#endif // HAVE_SSE2_SCAN
+
+
+/* scan_dir looks key up without an index */
+static struct direntry *scan_dir(uint16_t dir, const uint8_t *key,
+				 struct fat_volume *vol)
+{
+    struct direntry *block;
+    uint16_t cluster;
+    int n, i, nentries;
+
+    for (n = 0; (block = dir_block(dir, &cluster, n, &nentries, vol)); n++)
+    {
+	i = find_in_block(block, nentries, key);
+	if (i < nentries)
+	    return block[i].deName[0] == SLOT_EMPTY ? NULL : &block[i];
+    }
+    return NULL;
+}
+
+
+static struct dir_index *build_dir_index(uint16_t dir, struct fat_volume *vol)
+{
+    struct dir_index *idx;
+    struct direntry *block;
+    struct dir_slot *slot;
+    uint16_t cluster;
+    uint8_t key[DIRKEY_LEN];
+    uint32_t count = 0, nslots = 16, h;
+    int n, i, nentries, done;
+
+    /* count the entries, and note which directory each cluster is
+       part of, so writes to it can find the index */
+    done = FALSE;
+    for (n = 0; !done && (block = dir_block(dir, &cluster, n, &nentries, vol)); n++)
+    {
+	if (dir != MSDOSFSROOT)
+	    vol->dir_of[cluster] = dir;
+	for (i = 0; i < nentries; i++)
+	{
+	    if (block[i].deName[0] == SLOT_EMPTY)
+	    {
+		done = TRUE;
+		break;
+	    }
+	    if (is_named(&block[i]))
+		count++;
+	}
+    }
+
+    /* keep it at most half full */
+    while (nslots < 2 * count)
+	nslots *= 2;
+    idx = calloc(1, sizeof(struct dir_index) + nslots * sizeof(struct dir_slot));
+    idx->mask = nslots - 1;
+
+    done = FALSE;
+    for (n = 0; !done && (block = dir_block(dir, &cluster, n, &nentries, vol)); n++)
+    {
+	for (i = 0; i < nentries; i++)
+	{
+	    if (block[i].deName[0] == SLOT_EMPTY)
+	    {
+		done = TRUE;
+		break;
+	    }
+	    if (!is_named(&block[i]))
+		continue;
+	    dirent_key(&block[i], key);
+	    for (h = key_hash(key); ; h++)
+	    {
+		slot = &idx->slots[h & idx->mask];
+		if (slot->dirent == NULL)
+		{
+		    memcpy(slot->key, key, DIRKEY_LEN);
+		    slot->dirent = &block[i];
+		    break;
+		}
+		/* with duplicate names, the first one wins, as it
+		   would in a scan */
+		if (memcmp(slot->key, key, DIRKEY_LEN) == 0)
+		    break;
+	    }
+	}
+    }
+    return idx;
+}
+
+
+/* dir_lookup finds the entry called key in the directory starting at
+   cluster dir (MSDOSFSROOT for the root directory), or returns NULL */
+struct direntry *dir_lookup(uint16_t dir, const uint8_t *key,
+			    struct fat_volume *vol)
+{
+    struct dir_index *idx, *none = NULL;
+    struct dir_slot *slot;
+    uint32_t h;
+
+    /* the start cluster came off the disk, and indexes the tables
+       below */
+    if (dir != MSDOSFSROOT &&
+	(!is_valid_cluster(dir, vol) || dir >= vol->nclusters))
+	return NULL;
+
+    idx = __atomic_load_n(&vol->dirs[dir], __ATOMIC_ACQUIRE);
+    if (idx == NULL)
+    {
+	/* a one-off lookup isn't worth building an index for */
+	if (__atomic_add_fetch(&vol->dir_hits[dir], 1, __ATOMIC_RELAXED) < 2)
+	    return scan_dir(dir, key, vol);
+
+	idx = build_dir_index(dir, vol);
+	if (!__atomic_compare_exchange_n(&vol->dirs[dir], &none, idx, FALSE,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+	{
+	    /* someone else got there first */
+	    free(idx);
+	    idx = none;
+	}
+    }
+
+    for (h = key_hash(key); ; h++)
+    {
+	slot = &idx->slots[h & idx->mask];
+	if (slot->dirent == NULL)
+	    return NULL;
+	if (memcmp(slot->key, key, DIRKEY_LEN) == 0)
+	    return slot->dirent;
+    }
+}
+
+
+/* lookup_path resolves a '/' (or '\') separated path, starting from
+   the directory at cluster dir, and returns the entry for its last
+   component, or NULL.  If parent isn't NULL, it's set to the first
+   cluster of the directory that last component is (or would be) in,
+   or to -1 if that directory doesn't exist. */
+struct direntry *lookup_path(const char *path, uint16_t dir,
+			     int32_t *parent, struct fat_volume *vol)
+{
+    struct direntry *dirent = NULL;
+    uint8_t key[DIRKEY_LEN];
+    const char *end, *next;
+
+    if (dir == MSDOSFSROOT && catalog_lookup(path, &dirent, parent, vol))
+	return dirent;
+
+    while (*path == '/' || *path == '\\')
+	path++;
+
+    while (*path != '\0')
+    {
+	end = path + strcspn(path, "/\\");
+	next = end;
+	while (*next == '/' || *next == '\\')
+	    next++;
+
+	if (*next == '\0' && parent != NULL)
+	    *parent = dir;
+
+	dirent = NULL;
+	if (make_dir_key(path, end - path, key))
+	    dirent = dir_lookup(dir, key, vol);
+	if (*next == '\0')
+	    return dirent;
+
+	/* there's more to come, so this has to be a directory */
+	if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+	{
+	    if (parent != NULL)
+		*parent = -1;
+	    return NULL;
+	}
+	dir = getushort(dirent->deStartCluster);
+	path = next;
+    }
+
+    /* an empty path names the directory we started in, which has no
+       entry of its own */
+    if (parent != NULL)
+	*parent = dir;
+    return NULL;
+}
+
+
+/* drop_dir_index forgets the index for the directory at cluster dir */
+void drop_dir_index(uint16_t dir, struct fat_volume *vol)
+{
+    free(vol->dirs[dir]);
+    vol->dirs[dir] = NULL;
+    vol->dir_hits[dir] = 0;
+}
+
+
+/* dir_written is called after writing to the directory entry at
+   addr, and drops the index of the directory it's in */
+void dir_written(void *addr, struct fat_volume *vol)
+{
+    uint32_t off = (uint8_t *)addr - vol->image_buf;
+    uint32_t cluster;
+
+    vol->modified = TRUE;
+    vol->catalog_ok = FALSE;
+    if (off < vol->data_offset)
+    {
+	if (off >= vol->root_offset)
+	    drop_dir_index(MSDOSFSROOT, vol);
+	return;
+    }
+    cluster = CLUST_FIRST + (off - vol->data_offset) / vol->bytes_per_cluster;
+    if (cluster < FAT_NENTRIES && vol->dir_of[cluster] != 0)
+	drop_dir_index(vol->dir_of[cluster], vol);
+}
+
+
+void free_dir_indexes(struct fat_volume *vol)
+{
+    int i;
+
+    for (i = 0; i < FAT_NENTRIES; i++)
+	free(vol->dirs[i]);
+    memset(vol->dirs, 0, sizeof(vol->dirs));
+    memset(vol->dir_hits, 0, sizeof(vol->dir_hits));
+}
@@ -17,8 +17,15 @@
 
 static int imagesize = 0;
 
-/* memory map the FAT-12  disk image file */
-uint8_t *mmap_file(char *filename, int *fd)
+static void load_fat(struct fat_volume *);
+static uint8_t *cluster_addr_shift(struct fat_volume *, uint16_t);
+static uint8_t *cluster_addr_mul(struct fat_volume *, uint16_t);
+
+/* map_image memory maps the FAT-12 disk image file, read-only unless
+   writable is set, and returns the mapping (or NULL, having said why
+   not), its file descriptor and its size */
+static uint8_t *map_image(char *filename, int writable, int *fd,
+			  size_t *size)
 {
     struct stat statbuf;
     uint8_t *image_buf;
@@ -31,6 +38,7 @@ uint8_t *mmap_file(char *filename, int *fd)
     if (filename[0] == '/') 
     {
 	strncpy(pathname, filename, MAXPATHLEN);
+	pathname[MAXPATHLEN] = '\0';
     } 
     else 
     {
@@ -38,7 +46,7 @@ uint8_t *mmap_file(char *filename, int *fd)
 	if (strlen(pathname) + strlen(filename) + 1 > MAXPATHLEN) 
 	{
 	    fprintf(stderr, "Filename too long\n");
-	    exit(1);
+	    return NULL;
 	}
 	strcat(pathname, "/");
 	strcat(pathname, filename);
@@ -52,34 +60,49 @@ uint8_t *mmap_file(char *filename, int *fd)
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
 		pathname, strerror(errno));
-	exit(1);
+	return NULL;
     }
-    imagesize = statbuf.st_size;
+    *size = statbuf.st_size;
 
 
     /* Step 3: open the file for read/write */
 
-    *fd = open(pathname, O_RDWR);
+    *fd = open(pathname, writable ? O_RDWR : O_RDONLY);
     if (*fd < 0) 
     {
 	fprintf(stderr, "Cannot read disk image file %s:\n%s\n", 
 		pathname, strerror(errno));
-	exit(1);
+	return NULL;
     }
 
 
     /* Step 4: we memory map the file */
 
-    image_buf = mmap(NULL, imagesize, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    image_buf = mmap(NULL, *size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+		     MAP_SHARED, *fd, 0);
     if (image_buf == MAP_FAILED) 
     {
 	fprintf(stderr, "Failed to memory map: \n%s\n", strerror(errno));
-	exit(1);
+	close(*fd);
+	return NULL;
     }
     return image_buf;
 }
 
 
+/* memory map the FAT-12  disk image file */
+uint8_t *mmap_file(char *filename, int *fd)
+{
+    size_t size;
+    uint8_t *image_buf = map_image(filename, TRUE, fd, &size);
+
+    if (image_buf == NULL)
+	exit(1);
+    imagesize = size;
+    return image_buf;
+}
+
+
 void unmmap_file(uint8_t *image, int *fd)
 {
     munmap(image, imagesize);
@@ -165,75 +188,529 @@ struct bpb33* check_bootsector(uint8_t *image_buf)
     return bpb_aligned;
 }
 
-/* get_fat_entry returns the value from the FAT entry for
-   clusternum. */
-uint16_t get_fat_entry(uint16_t clusternum, 
-		       uint8_t *image_buf, struct bpb33* bpb)
+/* open_volume maps the disk image, checks its boot sector, and works
+   out everything about the layout that the rest of the code needs,
+   once, so nothing has to be rederived from the BPB on every call.
+   It returns NULL (having said why) if the image can't be opened.
+   A read-only volume's FAT can still be changed, but only in memory,
+   and nothing is ever written back. */
+static struct fat_volume *open_image(char *filename, int writable)
 {
-    uint32_t offset;
-    uint16_t value;
-    uint8_t b1, b2;
-    
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
-    switch(clusternum % 2) 
+    struct fat_volume *vol;
+    struct bpb33 *bpb;
+    uint32_t rootbytes;
+    int fd;
+    size_t size;
+    uint8_t *image_buf;
+    STAT_START(t);
+
+    image_buf = map_image(filename, writable, &fd, &size);
+    STAT_PHASE(STAT_MAP, t);
+    if (image_buf == NULL)
+	return NULL;
+    if (size < sizeof(struct bootsector33)) 
+    {
+	fprintf(stderr, "Disk image %s is too small\n", filename);
+	munmap(image_buf, size);
+	close(fd);
+	return NULL;
+    }
+
+    vol = malloc(sizeof(struct fat_volume));
+    memset(vol, 0, sizeof(struct fat_volume));
+    vol->image_buf = image_buf;
+    vol->fd = fd;
+    vol->size = size;
+    vol->readonly = !writable;
+    STAT_START(boot);
+    vol->bpb = bpb = check_bootsector(image_buf);
+    STAT_PHASE(STAT_BOOT, boot);
+
+    if (bpb->bpbBytesPerSec == 0 || bpb->bpbSecPerClust == 0 ||
+	(bpb->bpbBytesPerSec & (bpb->bpbBytesPerSec - 1)) != 0) 
+    {
+	fprintf(stderr, "Bad geometry in boot sector\n");
+	close_volume(vol);
+	return NULL;
+    }
+
+    vol->bytes_per_cluster = bpb->bpbBytesPerSec * bpb->bpbSecPerClust;
+    vol->cluster_mask = vol->bytes_per_cluster - 1;
+    vol->fat_offset = bpb->bpbResSectors * bpb->bpbBytesPerSec;
+    vol->root_offset = bpb->bpbBytesPerSec
+	* (bpb->bpbResSectors + bpb->bpbFATs * bpb->bpbFATsecs);
+    rootbytes = bpb->bpbRootDirEnts * sizeof(struct direntry);
+    vol->data_offset = vol->root_offset + rootbytes;
+    vol->max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
+
+    /* something that isn't a FAT-12 image at all, or one that's been
+       cut short, would send everything that follows off the end of
+       the mapping */
+    if (vol->data_offset > size ||
+	(uint32_t)bpb->bpbSectors * bpb->bpbBytesPerSec < vol->data_offset) 
     {
-    case 0:
-	b1 = *(image_buf + offset);
-	b2 = *(image_buf + offset + 1);
-
-	/* mjh: little-endian CPUs are ugly! */
-	value = ((0x0f & b2) << 8) | b1;
-	break;
-    case 1:
-	b1 = *(image_buf + offset + 1);
-	b2 = *(image_buf + offset + 2);
-	value = b2 << 4 | ((0xf0 & b1) >> 4);
-	break;
+	fprintf(stderr, "Bad geometry in boot sector\n");
+	close_volume(vol);
+	return NULL;
     }
-    return value;
+
+    /* only clusters that actually fit in the data area are handed
+       out: bpbSectors / bpbSecPerClust overcounts by the size of the
+       FAT and root directory, and those last few cluster numbers
+       would lie past the end of the image */
+    vol->nclusters = CLUST_FIRST +
+	(bpb->bpbSectors - bpb->bpbResSectors
+	 - bpb->bpbFATs * bpb->bpbFATsecs
+	 - (rootbytes + bpb->bpbBytesPerSec - 1) / bpb->bpbBytesPerSec)
+	/ bpb->bpbSecPerClust;
+    if (vol->nclusters > CLUST_FIRST
+	+ (size - vol->data_offset) / vol->bytes_per_cluster)
+	vol->nclusters = CLUST_FIRST
+	    + (size - vol->data_offset) / vol->bytes_per_cluster;
+
+    /* the standard geometries all have power-of-two clusters, so
+       cluster addresses can be a shift rather than a multiply */
+    if ((vol->bytes_per_cluster & vol->cluster_mask) == 0) 
+    {
+	vol->cluster_shift = __builtin_ctz(vol->bytes_per_cluster);
+	vol->cluster_addr = cluster_addr_shift;
+    } 
+    else 
+    {
+	vol->cluster_addr = cluster_addr_mul;
+    }
+
+    load_fat(vol);
+    catalog_open(filename, vol);
+    return vol;
 }
 
 
-/* set_fat_entry sets the value of the FAT entry for clusternum to value. */
-void set_fat_entry(uint16_t clusternum, uint16_t value,
-		   uint8_t *image_buf, struct bpb33* bpb)
+struct fat_volume *open_volume(char *filename)
 {
-    uint32_t offset;
-    uint8_t *p1, *p2;
-    
-    /* this involves some really ugly bit shifting.  This probably
-       only works on a little-endian machine. */
-    offset = bpb->bpbResSectors * bpb->bpbBytesPerSec * bpb->bpbSecPerClust 
-	+ (3 * (clusternum/2));
-    switch(clusternum % 2) 
+    return open_image(filename, TRUE);
+}
+
+struct fat_volume *open_volume_readonly(char *filename)
+{
+    return open_image(filename, FALSE);
+}
+
+
+/* sync_volume writes the FAT back into the image and flushes the
+   mapping to disk, without closing anything */
+void sync_volume(struct fat_volume *vol)
+{
+    if (vol->readonly)
+	return;
+    flush_fat(vol);
+    msync(vol->image_buf, vol->size, MS_SYNC);
+    if (vol->catalog != NULL && vol->modified)
+	catalog_write(vol);
+}
+
+
+/* close_volume writes back anything still pending, unmaps the image
+   and frees the volume */
+void close_volume(struct fat_volume *vol)
+{
+    flush_fat(vol);
+    if (vol->catalog != NULL && vol->modified && !vol->readonly)
+	catalog_write(vol);
+    catalog_close(vol);
+    free_dir_indexes(vol);
+    munmap(vol->image_buf, vol->size);
+    close(vol->fd);
+    free(vol->bpb);
+    free(vol);
+}
+
+
+/* The FAT is kept decoded in memory, one uint16_t per cluster, so
+   that following a chain is a plain array lookup rather than a
+   12-bit unpack of the mapped image on every hop.  Writes go to the
+   decoded table and mark the chunk they fall in as dirty;
+   flush_fat() repacks only the dirty chunks into the image.
+
+   Alongside it is a free space bitmap, one bit per cluster, set if
+   the cluster is free.  It is kept in step with the table by
+   set_fat_entry, so finding a free cluster never has to scan the FAT
+   itself. */
+
+static void set_free_bit(struct fat_volume *vol, uint32_t clusternum, 
+			 int is_free)
+{
+    if (clusternum < CLUST_FIRST || clusternum >= vol->nclusters)
+	return;
+    if (is_free)
+	vol->freemap[clusternum / 64] |= 1ULL << (clusternum % 64);
+    else
+	vol->freemap[clusternum / 64] &= ~(1ULL << (clusternum % 64));
+}
+
+/* load_fat decodes the whole FAT of the image into vol->fat, and
+   builds the free space bitmap from it */
+static void load_fat(struct fat_volume *vol)
+{
+    struct perf_mark pm;
+    uint32_t avail, i;
+
+    vol->fat_dirty = 0;
+
+    /* the original code addressed all 4096 entries from the start of
+       the first FAT, so do the same, as long as the image is big
+       enough to hold them */
+    avail = vol->size > vol->fat_offset ? vol->size - vol->fat_offset : 0;
+    vol->fat_nentries = (avail / 3) * 2;
+    if (vol->fat_nentries > FAT_NENTRIES)
+	vol->fat_nentries = FAT_NENTRIES;
+
+    memset(vol->fat, 0, sizeof(vol->fat));
+    perf_begin(&pm);
+    fat12_unpack(vol->image_buf + vol->fat_offset, vol->fat, 
+		 0, vol->fat_nentries);
+    perf_end(PERF_FAT_DECODE, &pm, vol->fat_nentries * 3 / 2);
+
+    if (vol->nclusters > vol->fat_nentries)
+	vol->nclusters = vol->fat_nentries;
+    vol->fat_cursor = CLUST_FIRST;
+    memset(vol->freemap, 0, sizeof(vol->freemap));
+    for (i = CLUST_FIRST; i < vol->nclusters; i++)
+	set_free_bit(vol, i, vol->fat[i] == CLUST_FREE);
+}
+
+
+/* scan the free bitmap for the first cluster in [from, to) whose
+   free bit equals want, a 64-bit word at a time.  Returns 0 if there
+   is none. */
+static uint32_t scan_freemap(struct fat_volume *vol, 
+			     uint32_t from, uint32_t to, int want)
+{
+    uint32_t w;
+    uint64_t bits, flip = want ? 0 : ~0ULL;
+
+    if (from >= to)
+	return 0;
+    w = from / 64;
+    bits = (vol->freemap[w] ^ flip) & (~0ULL << (from % 64));
+    while (1) 
+    {
+	if (bits != 0) 
+	{
+	    from = w * 64 + __builtin_ctzll(bits);
+	    return from < to ? from : 0;
+	}
+	if (++w * 64 >= to)
+	    return 0;
+	bits = vol->freemap[w] ^ flip;
+    }
+}
+
+#define scan_free(vol, from, to) scan_freemap((vol), (from), (to), TRUE)
+#define scan_used(vol, from, to) scan_freemap((vol), (from), (to), FALSE)
+
+
+/* find_free_cluster returns a free cluster, or 0 if the disk is
+   full.  The search is next-fit: it carries on from just after the
+   cluster it returned last time, wrapping round to the start of the
+   disk.  The cluster is not marked as used until the caller stores
+   something in its FAT entry. */
+uint16_t find_free_cluster(struct fat_volume *vol)
+{
+    uint32_t cluster;
+
+    if (vol->fat_cursor < CLUST_FIRST || vol->fat_cursor >= vol->nclusters)
+	vol->fat_cursor = CLUST_FIRST;
+
+    cluster = scan_free(vol, vol->fat_cursor, vol->nclusters);
+    if (cluster == 0)
+	cluster = scan_free(vol, CLUST_FIRST, vol->fat_cursor);
+    if (cluster != 0)
+	vol->fat_cursor = cluster + 1;
+    return cluster;
+}
+
+
+/* flush_fat writes the dirty parts of the decoded FAT back into the
+   memory mapped image */
+void flush_fat(struct fat_volume *vol)
+{
+    uint32_t chunk, first, last;
+    uint32_t nchunks = FAT_NENTRIES >> FAT_CHUNK_SHIFT;
+
+    if (vol->fat_dirty == 0 || vol->readonly)
+	return;
+
+    chunk = 0;
+    while (chunk < nchunks) 
+    {
+	if ((vol->fat_dirty & (1ULL << chunk)) == 0) 
+	{
+	    chunk++;
+	    continue;
+	}
+
+	/* coalesce adjacent dirty chunks into one range */
+	first = chunk << FAT_CHUNK_SHIFT;
+	while (chunk < nchunks && (vol->fat_dirty & (1ULL << chunk)))
+	    chunk++;
+	last = chunk << FAT_CHUNK_SHIFT;
+	if (last > vol->fat_nentries)
+	    last = vol->fat_nentries;
+	if (first < last)
+	    fat12_pack(vol->image_buf + vol->fat_offset, vol->fat, first, last - first);
+    }
+    vol->fat_dirty = 0;
+}
+
+
+/* runs of free clusters, largest first, ties broken by position */
+static int cmp_extent_len(const void *a, const void *b)
+{
+    const struct extent *x = a, *y = b;
+    if (x->count != y->count)
+	return y->count - x->count;
+    return x->start - y->start;
+}
+
+static int cmp_extent_start(const void *a, const void *b)
+{
+    const struct extent *x = a, *y = b;
+    return x->start - y->start;
+}
+
+
+/* alloc_chain allocates nclusters clusters for a new file, writes the
+   whole FAT chain for them in one pass, and returns the first
+   cluster, or 0 if there isn't enough free space (in which case
+   nothing is changed).
+
+   If a single run of free clusters is big enough, the smallest such
+   run is used, so the file ends up contiguous without breaking up a
+   larger hole.  Otherwise the file is split over as few runs as
+   possible: the largest runs, with the last piece going in the
+   smallest run that will hold it. */
+uint16_t alloc_chain(uint32_t nclusters, struct fat_volume *vol)
+{
+    struct extent *runs;
+    uint32_t nruns = 0, maxruns, cluster, end, i, j, k, need, got;
+    uint16_t prev;
+    int best;
+
+    if (nclusters == 0)
+	return 0;
+
+    /* gather every run of free clusters */
+    maxruns = vol->nclusters / 2 + 1;
+    runs = malloc(maxruns * sizeof(struct extent));
+    cluster = scan_free(vol, CLUST_FIRST, vol->nclusters);
+    while (cluster != 0) 
+    {
+	end = scan_used(vol, cluster, vol->nclusters);
+	if (end == 0)
+	    end = vol->nclusters;
+	runs[nruns].start = cluster;
+	runs[nruns].count = end - cluster;
+	nruns++;
+	cluster = scan_free(vol, end, vol->nclusters);
+    }
+
+    /* best fit: the smallest run that holds the whole file */
+    best = -1;
+    for (i = 0; i < nruns; i++) 
+    {
+	if (runs[i].count >= nclusters &&
+	    (best < 0 || runs[i].count < runs[best].count))
+	    best = i;
+    }
+
+    if (best >= 0) 
+    {
+	runs[0].start = runs[best].start;
+	runs[0].count = nclusters;
+	k = 1;
+    } 
+    else 
+    {
+	/* fewest extents: take the largest runs until the file fits */
+	qsort(runs, nruns, sizeof(struct extent), cmp_extent_len);
+	got = 0;
+	for (k = 0; k < nruns && got < nclusters; k++)
+	    got += runs[k].count;
+	if (got < nclusters) 
+	{
+	    free(runs);
+	    return 0;
+	}
+
+	/* the last piece only needs the remainder, so put it in the
+	   smallest of the remaining runs that can take it */
+	need = nclusters - (got - runs[k - 1].count);
+	for (j = k; j < nruns && runs[j].count >= need; j++)
+	    ;
+	runs[k - 1] = runs[j - 1];
+	runs[k - 1].count = need;
+
+	/* lay the pieces out in disk order */
+	qsort(runs, k, sizeof(struct extent), cmp_extent_start);
+    }
+
+    /* write the chain */
+    prev = 0;
+    for (i = 0; i < k; i++) 
+    {
+	for (j = 0; j < runs[i].count; j++) 
+	{
+	    cluster = runs[i].start + j;
+	    if (prev != 0)
+		set_fat_entry(prev, cluster, vol);
+	    prev = cluster;
+	}
+    }
+    set_fat_entry(prev, FAT12_MASK & CLUST_EOFS, vol);
+    vol->fat_cursor = prev + 1;
+
+    cluster = runs[0].start;
+    free(runs);
+    return cluster;
+}
+
+
+/* free_chain marks every cluster in the chain starting at cluster
+   as free */
+void free_chain(uint16_t cluster, struct fat_volume *vol)
+{
+    uint16_t next;
+
+    while (is_valid_cluster(cluster, vol)) 
+    {
+	next = get_fat_entry(cluster, vol);
+	if (next == CLUST_FREE)
+	    break;
+	set_fat_entry(cluster, FAT12_MASK & CLUST_FREE, vol);
+	cluster = next;
+    }
+}
+
+
+/* chain_extents follows the chain starting at cluster and collapses
+   it into runs of physically contiguous clusters.  The runs are
+   returned in a malloc'd array in *extents (which the caller frees),
+   and the number of runs is returned.  At most as many clusters as
+   the disk holds are followed, so a looped chain can't hang us. */
+int chain_extents(uint16_t cluster, struct extent **extents,
+		  struct fat_volume *vol)
+{
+    struct extent *ext = NULL;
+    int n = 0, max = 0;
+    uint32_t budget = vol->max_cluster;
+
+    n = catalog_extents(cluster, extents, vol);
+    if (n >= 0)
+	return n;
+    n = 0;
+
+    while (is_valid_cluster(cluster, vol) && budget-- > 0) 
+    {
+	if (n > 0 && ext[n - 1].start + ext[n - 1].count == cluster) 
+	{
+	    ext[n - 1].count++;
+	} 
+	else 
+	{
+	    if (n == max) 
+	    {
+		max = max ? max * 2 : 8;
+		ext = realloc(ext, max * sizeof(struct extent));
+	    }
+	    ext[n].start = cluster;
+	    ext[n].count = 1;
+	    n++;
+	}
+	cluster = get_fat_entry(cluster, vol);
+    }
+    *extents = ext;
+    return n;
+}
+
+
+/* count_free_clusters returns the number of free data clusters */
+int count_free_clusters(struct fat_volume *vol)
+{
+    int w, nfree = 0;
+
+    for (w = 0; w < FREEMAP_WORDS; w++)
+	nfree += __builtin_popcountll(vol->freemap[w]);
+    return nfree;
+}
+
+
+/* compare_fat_copies decodes every backup FAT in bulk and returns
+   the number of cluster entries in which any of them disagrees with
+   the first FAT (as currently held in memory) */
+int compare_fat_copies(struct fat_volume *vol)
+{
+    uint16_t *copy;
+    uint32_t i, n, fatbytes;
+    int f, mismatches = 0;
+
+    fatbytes = vol->bpb->bpbFATsecs * vol->bpb->bpbBytesPerSec;
+    n = (fatbytes / 3) * 2;
+    if (n > vol->max_cluster)
+	n = vol->max_cluster;
+    if (n > vol->fat_nentries)
+	n = vol->fat_nentries;
+
+    copy = malloc(n * sizeof(uint16_t));
+    for (f = 1; f < vol->bpb->bpbFATs; f++) 
     {
-    case 0:
-	p1 = image_buf + offset;
-	p2 = image_buf + offset + 1;
-	/* mjh: little-endian CPUs are really ugly! */
-	*p1 = (uint8_t)(0xff & value);
-	*p2 = (uint8_t)((0xf0 & (*p2)) | (0x0f & (value >> 8)));
-	break;
-    case 1:
-	p1 = image_buf + offset + 1;
-	p2 = image_buf + offset + 2;
-	*p1 = (uint8_t)((0x0f & (*p1)) | ((0x0f & value) << 4));
-	*p2 = (uint8_t)(0xff & (value >> 4));
-	break;
+	if (vol->fat_offset + (f + 1) * fatbytes > vol->size)
+	    break;
+	fat12_unpack(vol->image_buf + vol->fat_offset + f * fatbytes, copy, 0, n);
+	for (i = 0; i < n; i++)
+	    mismatches += (copy[i] != vol->fat[i]);
     }
+    free(copy);
+    return mismatches;
+}
+
+
+/* get_fat_entry returns the value from the FAT entry for
+   clusternum. */
+uint16_t get_fat_entry(uint16_t clusternum, 
+		       struct fat_volume *vol)
+{
+    STAT_ADD(fat_reads, 1);
+    if (clusternum >= vol->fat_nentries)
+	return FAT12_MASK & CLUST_BAD;
+    return vol->fat[clusternum];
 }
 
 
-int is_valid_cluster(uint16_t cluster, struct bpb33 *bpb)
+/* set_fat_entry sets the value of the FAT entry for clusternum to value. */
+void set_fat_entry(uint16_t clusternum, uint16_t value,
+		   struct fat_volume *vol)
 {
-    uint16_t max_cluster = (bpb->bpbSectors / bpb->bpbSecPerClust) & FAT12_MASK;
+    STAT_ADD(fat_writes, 1);
+    if (clusternum >= vol->fat_nentries)
+	return;
+    vol->fat[clusternum] = value & FAT12_MASK;
+    vol->fat_dirty |= 1ULL << (clusternum >> FAT_CHUNK_SHIFT);
+    set_free_bit(vol, clusternum, vol->fat[clusternum] == CLUST_FREE);
+    vol->modified = TRUE;
+    vol->catalog_ok = FALSE;
+
+    /* a directory's chain changing makes its name index stale */
+    if (vol->dir_of[clusternum] != 0)
+	drop_dir_index(vol->dir_of[clusternum], vol);
+}
+
 
+int is_valid_cluster(uint16_t cluster, struct fat_volume *vol)
+{
     if (cluster >= (FAT12_MASK & CLUST_FIRST) && 
         cluster <= (FAT12_MASK & CLUST_LAST) &&
-        cluster < max_cluster)
+        cluster < vol->max_cluster)
         return TRUE;
     return FALSE;
 }
@@ -257,31 +734,286 @@ int is_end_of_file(uint16_t cluster)
 
 /* root_dir_addr returns the address in the mmapped disk image for the
    start of the root directory, as indicated in the boot sector */
-uint8_t *root_dir_addr(uint8_t *image_buf, struct bpb33* bpb)
+uint8_t *root_dir_addr(struct fat_volume *vol)
+{
+    return vol->image_buf + vol->root_offset;
+}
+
+
+/* the two flavours of cluster_to_addr; open_volume picks one */
+static uint8_t *cluster_addr_shift(struct fat_volume *vol, uint16_t cluster)
 {
-    uint32_t offset;
-    offset = 
-	(bpb->bpbBytesPerSec 
-	 * (bpb->bpbResSectors + (bpb->bpbFATs * bpb->bpbFATsecs)));
-    return image_buf + offset;
+    return vol->image_buf + vol->data_offset 
+	+ ((uint32_t)(cluster - CLUST_FIRST) << vol->cluster_shift);
+}
+
+static uint8_t *cluster_addr_mul(struct fat_volume *vol, uint16_t cluster)
+{
+    return vol->image_buf + vol->data_offset 
+	+ (uint32_t)(cluster - CLUST_FIRST) * vol->bytes_per_cluster;
 }
 
 
 /* cluster_to_addr returns the memory location where the memory mapped
    cluster actually starts */
-uint8_t *cluster_to_addr(uint16_t cluster, uint8_t *image_buf, 
-			 struct bpb33* bpb)
+uint8_t *cluster_to_addr(uint16_t cluster, struct fat_volume *vol)
+{
+    if (cluster == MSDOSFSROOT) 
+	return vol->image_buf + vol->root_offset;
+    STAT_ADD(clusters, 1);
+    return vol->cluster_addr(vol, cluster);
+}
+
+
+/* fat_open returns a handle for reading the file described by
+   dirent.  The file's cluster chain isn't looked at until the first
+   fat_pread, which collapses it into a list of extents and keeps it
+   on the handle, so any later read can find its starting cluster by
+   binary search instead of walking the chain from the front. */
+struct fat_file *fat_open(struct direntry *dirent,
+			  struct fat_volume *vol)
+{
+    struct fat_file *file = malloc(sizeof(struct fat_file));
+
+    file->start_cluster = getushort(dirent->deStartCluster);
+    file->size = getulong(dirent->deFileSize);
+    file->extents = NULL;
+    file->ext_first = NULL;
+    file->nextents = -1;
+    file->vol = vol;
+    return file;
+}
+
+
+void fat_close(struct fat_file *file)
 {
-    uint8_t *p;
-    p = root_dir_addr(image_buf, bpb);
-    if (cluster != MSDOSFSROOT) 
+    free(file->extents);
+    free(file->ext_first);
+    free(file);
+}
+
+
+/* build the seek index: ext_first[i] is the index, within the file,
+   of the first cluster of extent i */
+static void build_seek_index(struct fat_file *file)
+{
+    uint32_t n = 0;
+    int i;
+
+    file->nextents = chain_extents(file->start_cluster, &file->extents,
+				   file->vol);
+    file->ext_first = malloc((file->nextents + 1) * sizeof(uint32_t));
+    for (i = 0; i < file->nextents; i++) 
     {
-	/* move to the end of the root directory */
-	p += bpb->bpbRootDirEnts * sizeof(struct direntry);
+	file->ext_first[i] = n;
+	n += file->extents[i].count;
+    }
+    file->ext_first[i] = n;
+}
 
-	/* move forward the right number of clusters */
-	p += bpb->bpbBytesPerSec * bpb->bpbSecPerClust * (cluster - CLUST_FIRST);
+
+/* fat_pread copies up to len bytes from byte offset offset of the file
+   into buf, and returns the number of bytes copied.  It stops short
+   at the end of the file, or where the cluster chain ends early. */
+ssize_t fat_pread(struct fat_file *file, void *buf, size_t len, 
+		  uint32_t offset)
+{
+    uint32_t clust_size, clust, skip, n;
+    uint8_t *out = buf;
+    size_t done = 0;
+    int lo, hi, mid;
+
+    if (offset >= file->size)
+	return 0;
+    if (len > file->size - offset)
+	len = file->size - offset;
+
+    if (file->nextents < 0)
+	build_seek_index(file);
+    if (file->nextents == 0)
+	return 0;
+
+    clust_size = file->vol->bytes_per_cluster;
+    clust = offset / clust_size;
+
+    /* find the extent holding cluster number clust of the file */
+    lo = 0;
+    hi = file->nextents - 1;
+    while (lo < hi) 
+    {
+	mid = (lo + hi + 1) / 2;
+	if (file->ext_first[mid] <= clust)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+
+    /* and copy, an extent at a time */
+    while (done < len && lo < file->nextents) 
+    {
+	skip = offset + done - file->ext_first[lo] * clust_size;
+	n = file->extents[lo].count * clust_size;
+	if (skip >= n)
+	    break;      /* the chain ran out before the file did */
+	n -= skip;
+	if (n > len - done)
+	    n = len - done;
+	memcpy(out + done, 
+	       cluster_to_addr(file->extents[lo].start, file->vol) + skip, 
+	       n);
+	done += n;
+	lo++;
     }
-    return p;
+    STAT_ADD(bytes_copied, done);
+    return done;
 }
 
+
+/* Walking the directory tree.  walk_dirs visits every entry of the
+   directory at cluster dir (MSDOSFSROOT for the root) in order, and,
+   whenever visit returns a directory's first cluster, that
+   directory's entries before going on to the next one - the same
+   order as a recursive walk, but with an explicit stack, so a deep
+   tree can't overflow the C stack.  Each directory cluster is only
+   walked once, so a corrupt image whose directories loop back on
+   themselves (or share clusters) can't send it round forever.
+
+   As each cluster of a directory is started on, the next cluster of
+   its chain and the first clusters of the subdirectories in it are
+   asked for with madvise, so the kernel can be reading them while
+   this one is being processed. */
+
+struct walk_frame {
+    uint16_t cluster;           /* the cluster being walked */
+    int index;                  /* next entry in it */
+    int depth;
+};
+
+struct dir_walk {
+    struct fat_volume *vol;
+    uint64_t visited[FREEMAP_WORDS];
+    uint8_t *advised;           /* one byte per page of the image */
+    long pagesize;
+};
+
+
+/* will_need asks for the page(s) holding a cluster to be read in */
+static void will_need(struct dir_walk *walk, uint16_t cluster)
+{
+    struct fat_volume *vol = walk->vol;
+    uint32_t off, page, last;
+
+    if (!is_valid_cluster(cluster, vol) || cluster >= vol->nclusters)
+	return;
+    off = cluster_to_addr(cluster, vol) - vol->image_buf;
+    page = off / walk->pagesize;
+    last = (off + vol->bytes_per_cluster - 1) / walk->pagesize;
+    __builtin_prefetch(vol->image_buf + off);
+    if (walk->advised[page] && walk->advised[last])
+	return;
+    memset(walk->advised + page, 1, last - page + 1);
+    madvise(vol->image_buf + page * walk->pagesize,
+	    (last - page + 1) * walk->pagesize, MADV_WILLNEED);
+}
+
+
+/* enter_cluster checks that a directory cluster can be walked, and
+   hasn't been already, and starts reading ahead of it */
+static int enter_cluster(struct dir_walk *walk, uint16_t cluster)
+{
+    struct fat_volume *vol = walk->vol;
+    struct direntry *dirent;
+    int i, n;
+
+    if (!is_valid_cluster(cluster, vol) || cluster >= vol->nclusters ||
+	(walk->visited[cluster / 64] & (1ULL << (cluster % 64))))
+	return FALSE;
+    walk->visited[cluster / 64] |= 1ULL << (cluster % 64);
+
+    will_need(walk, get_fat_entry(cluster, vol));
+    dirent = (struct direntry *)cluster_to_addr(cluster, vol);
+    n = vol->bytes_per_cluster / sizeof(struct direntry);
+    for (i = 0; i < n; i++)
+	if ((dirent[i].deAttributes & ATTR_DIRECTORY) != 0 &&
+	    dirent[i].deName[0] != SLOT_EMPTY &&
+	    dirent[i].deName[0] != SLOT_DELETED &&
+	    dirent[i].deName[0] != '.')
+	    will_need(walk, getushort(dirent[i].deStartCluster));
+    return TRUE;
+}
+
+
+void walk_dirs(uint16_t dir, int depth, dir_visitor visit, void *arg,
+	       struct fat_volume *vol)
+{
+    struct dir_walk walk;
+    struct walk_frame *stack, *f;
+    struct direntry *dirent;
+    struct perf_mark pm;
+    int sp = 0, max = 16, nentries;
+    uint64_t nvisited = 0;
+    uint16_t follow;
+    STAT_START(t);
+
+    perf_begin(&pm);
+    memset(walk.visited, 0, sizeof(walk.visited));
+    walk.vol = vol;
+    walk.pagesize = sysconf(_SC_PAGESIZE);
+    walk.advised = calloc(vol->size / walk.pagesize + 1, 1);
+
+    stack = malloc(max * sizeof(struct walk_frame));
+    if (dir == MSDOSFSROOT || enter_cluster(&walk, dir))
+    {
+	stack[0].cluster = dir;
+	stack[0].index = 0;
+	stack[0].depth = depth;
+	sp = 1;
+    }
+
+    while (sp > 0)
+    {
+	f = &stack[sp - 1];
+	nentries = f->cluster == MSDOSFSROOT ? vol->bpb->bpbRootDirEnts
+	    : vol->bytes_per_cluster / sizeof(struct direntry);
+
+	/* on to the directory's next cluster, or back up to its
+	   parent if that was the last */
+	if (f->index == nentries)
+	{
+	    if (f->cluster == MSDOSFSROOT)
+		sp--;
+	    else
+	    {
+		f->cluster = get_fat_entry(f->cluster, vol);
+		f->index = 0;
+		if (!enter_cluster(&walk, f->cluster))
+		    sp--;
+	    }
+	    continue;
+	}
+
+	dirent = (struct direntry *)cluster_to_addr(f->cluster, vol)
+	    + f->index++;
+	nvisited++;
+	STAT_ADD(dirents, 1);
+	follow = visit(dirent, f->depth, arg);
+	if (follow == 0 || !enter_cluster(&walk, follow))
+	    continue;
+
+	if (sp == max)
+	{
+	    max *= 2;
+	    stack = realloc(stack, max * sizeof(struct walk_frame));
+	    f = &stack[sp - 1];
+	}
+	stack[sp].cluster = follow;
+	stack[sp].index = 0;
+	stack[sp].depth = f->depth + 1;
+	sp++;
+    }
+
+    free(stack);
+    free(walk.advised);
+    perf_end(PERF_TRAVERSE, &pm, nvisited * sizeof(struct direntry));
+    STAT_PHASE(STAT_TRAVERSE, t);
+}
@@ -12,21 +12,258 @@
 /* prototypes for functions in dos.c */
 
 #include <stdint.h>
+#include <sys/types.h>
+
+#define FAT_NENTRIES     (FAT12_MASK + 1)  /* every 12-bit cluster number */
+#define FAT_CHUNK_SHIFT  6                 /* 64 entries (96 bytes) per chunk */
+#define FREEMAP_WORDS    (FAT_NENTRIES / 64)
+#define DIRKEY_LEN       11                /* an 8.3 name, as on disk */
+
+struct dir_index;
+struct cat_header;
+
+/* an open disk image, with its layout worked out up front and its
+   FAT decoded */
+struct fat_volume {
+    uint8_t *image_buf;         /* the memory mapped image */
+    int fd;
+    size_t size;
+    int readonly;               /* mapped read-only */
+    struct bpb33 *bpb;
+
+    /* layout, as byte offsets into the image */
+    uint32_t fat_offset;        /* first FAT */
+    uint32_t root_offset;       /* root directory */
+    uint32_t data_offset;       /* cluster 2 */
+    uint32_t bytes_per_cluster;
+    uint32_t cluster_shift;     /* log2(bytes_per_cluster), if a power of 2 */
+    uint32_t cluster_mask;      /* bytes_per_cluster - 1 */
+    uint32_t max_cluster;       /* cluster numbers below this are valid */
+    uint32_t nclusters;         /* one past the last cluster in the data area */
+    uint8_t *(*cluster_addr)(struct fat_volume *, uint16_t);
+
+    /* the decoded FAT */
+    uint16_t fat[FAT_NENTRIES];
+    uint32_t fat_nentries;      /* entries actually backed by the image */
+    uint64_t fat_dirty;         /* one bit per dirty chunk */
+    uint64_t freemap[FREEMAP_WORDS]; /* one bit per cluster, set if free */
+    uint32_t fat_cursor;        /* where the next free cluster search starts */
+
+    /* directory name indexes (see dirindex.c), by first cluster */
+    struct dir_index *dirs[FAT_NENTRIES];
+    uint16_t dir_of[FAT_NENTRIES];  /* directory each cluster was indexed in */
+    uint8_t dir_hits[FAT_NENTRIES]; /* lookups while unindexed */
+
+    /* the path catalog sidecar (see catalog.c), if the image has one */
+    char *catalog_path;         /* NULL if it doesn't */
+    struct cat_header *catalog; /* mapped read-only */
+    size_t catalog_size;
+    int catalog_ok;             /* the catalog matches the image */
+    int modified;               /* the catalog needs rebuilding */
+};
+
+/* a run of physically contiguous clusters */
+struct extent {
+    uint16_t start;
+    uint16_t count;
+};
+
+/* an open file in the disk image, for random access reads */
+struct fat_file {
+    uint16_t start_cluster;
+    uint32_t size;
+    struct extent *extents;     /* the cluster chain, built lazily */
+    uint32_t *ext_first;        /* index in the file of each extent's
+				   first cluster */
+    int nextents;               /* -1 until the chain has been read */
+    struct fat_volume *vol;
+};
 
 uint8_t *mmap_file(char *, int *);
 void unmmap_file(uint8_t *, int *);
 
 struct bpb33* check_bootsector(uint8_t *);
 
-uint16_t get_fat_entry(uint16_t, uint8_t *, struct bpb33 *);
+struct fat_volume *open_volume(char *);
+struct fat_volume *open_volume_readonly(char *);
+void close_volume(struct fat_volume *);
+void sync_volume(struct fat_volume *);
+
+uint16_t get_fat_entry(uint16_t, struct fat_volume *);
 
-void set_fat_entry(uint16_t, uint16_t, uint8_t *, struct bpb33 *);
+void set_fat_entry(uint16_t, uint16_t, struct fat_volume *);
+void flush_fat(struct fat_volume *);
+uint16_t find_free_cluster(struct fat_volume *);
+uint16_t alloc_chain(uint32_t, struct fat_volume *);
+void free_chain(uint16_t, struct fat_volume *);
+int chain_extents(uint16_t, struct extent **, struct fat_volume *);
+int count_free_clusters(struct fat_volume *);
+int compare_fat_copies(struct fat_volume *);
 
 int is_end_of_file(uint16_t);
-int is_valid_cluster(uint16_t, struct bpb33 *);
+int is_valid_cluster(uint16_t, struct fat_volume *);
+
+uint8_t *root_dir_addr(struct fat_volume *);
+
+uint8_t *cluster_to_addr(uint16_t, struct fat_volume *);
+
+/* called by walk_dirs for each directory entry, with the depth of
+   the directory it's in; returns the first cluster of a directory to
+   walk into next, or 0 */
+typedef uint16_t (*dir_visitor)(struct direntry *, int, void *);
+void walk_dirs(uint16_t, int, dir_visitor, void *, struct fat_volume *);
+
+struct fat_file *fat_open(struct direntry *, struct fat_volume *);
+ssize_t fat_pread(struct fat_file *, void *, size_t, uint32_t);
+void fat_close(struct fat_file *);
+
+/* prototypes for functions in dosops.c */
+
+#include <stdio.h>
+
+/* flags for find_file, depending on whether we're searching for a
+   file or a directory */
+#define FIND_FILE 0
+#define FIND_DIR 1
+
+void ls_indent(FILE *, int);
+uint16_t ls_dirent(FILE *, struct direntry *, int);
+void ls_dir(FILE *, uint16_t, int, struct fat_volume *);
+void list_volume(FILE *, struct fat_volume *);
+int list_path(FILE *, char *, struct fat_volume *);
+
+uint16_t get_dirent(struct direntry *, char *);
+struct direntry *find_path(char *, struct fat_volume *);
+int cat_file(struct direntry *, int, struct fat_volume *);
+int cat_range(struct direntry *, uint32_t, uint32_t, int,
+	      struct fat_volume *);
+
+void get_name(char *, struct direntry *);
+struct direntry *find_file(char *, uint16_t, int, struct fat_volume *);
+int copy_out_file(int, uint16_t, uint32_t, struct fat_volume *);
+int copyout(char *, char *, struct fat_volume *);
+int copy_in_file(int, struct fat_volume *, uint16_t *, uint32_t *);
+void write_dirent(struct direntry *, char *, uint16_t, uint32_t);
+void create_dirent(struct direntry *, char *, uint16_t, uint32_t,
+		   struct fat_volume *);
+int copyin_fd(int, char *, struct fat_volume *);
+int copyin(char *, char *, struct fat_volume *);
+
+/* prototypes for functions in dirindex.c */
+
+int make_dir_key(const char *, size_t, uint8_t *);
+struct direntry *dir_lookup(uint16_t, const uint8_t *, struct fat_volume *);
+struct direntry *lookup_path(const char *, uint16_t, int32_t *,
+			     struct fat_volume *);
+void drop_dir_index(uint16_t, struct fat_volume *);
+void dir_written(void *, struct fat_volume *);
+void free_dir_indexes(struct fat_volume *);
+void dirent_key(struct direntry *, uint8_t *);
+int is_named(struct direntry *);
+
+/* prototypes for functions in catalog.c */
+
+void catalog_open(char *, struct fat_volume *);
+void catalog_close(struct fat_volume *);
+int catalog_lookup(const char *, struct direntry **, int32_t *,
+		   struct fat_volume *);
+int catalog_extents(uint16_t, struct extent **, struct fat_volume *);
+int catalog_write(struct fat_volume *);
+uint64_t hash64(uint64_t, const void *, size_t);
+
+/* prototypes for functions in fatgraph.c */
+
+/* flags[] bits */
+#define FG_USED  0x01           /* allocated: not free or bad */
+#define FG_HEAD  0x02           /* no chain runs into it */
+#define FG_JOIN  0x04           /* more than one chain runs into it */
+
+/* end[]: why the chain stops at a cluster with no next[] */
+#define FG_EOF   1              /* end of file marker */
+#define FG_FREE  2              /* links to a free cluster */
+#define FG_BAD   3              /* links to a bad cluster */
+#define FG_RANGE 4              /* links to a cluster that isn't there */
+#define FG_SELF  5              /* links to itself */
+#define FG_LOOP  6              /* links back into its own chain */
+
+/* the chains in the FAT, and how they fit together */
+struct fat_graph {
+    uint32_t n;                 /* cluster numbers below this */
+    uint16_t *next;             /* successor, or 0 where the chain stops */
+    uint16_t *indeg;            /* chains running in, once loops are cut */
+    uint8_t *flags;
+    uint8_t *end;
+    uint32_t nused, nheads, njoins, nloops;
+};
+
+struct fat_graph *build_fat_graph(struct fat_volume *, const uint64_t *);
+void free_fat_graph(struct fat_graph *);
+
+/* prototypes for functions in stats.c */
+
+/* the phases --stats times */
+#define STAT_MAP       0        /* mapping the image */
+#define STAT_BOOT      1        /* checking the boot sector */
+#define STAT_TRAVERSE  2        /* walking the directory tree */
+#define STAT_REPAIR    3        /* scandisk's repairs */
+#define STAT_NPHASES   4
+
+/* the hot path counters, all uint64_t so they can be added up as an
+   array */
+struct dos_stats {
+    uint64_t fat_reads;
+    uint64_t fat_writes;
+    uint64_t clusters;          /* data clusters touched */
+    uint64_t dirents;           /* directory entries scanned */
+    uint64_t bytes_copied;
+    uint64_t phase_ns[STAT_NPHASES];
+};
+
+/* without DOS_STATS, the counters compile to nothing */
+#ifdef DOS_STATS
+extern __thread struct dos_stats thread_stats;
+#define STAT_ADD(counter, n)   (thread_stats.counter += (n))
+#define STAT_START(t)          uint64_t t = stats_now()
+#define STAT_PHASE(phase, t)   (thread_stats.phase_ns[phase] += stats_now() - (t))
+#else
+#define STAT_ADD(counter, n)   ((void)0)
+#define STAT_START(t)
+#define STAT_PHASE(phase, t)   ((void)0)
+#endif
+
+uint64_t stats_now(void);
+void stats_merge(void);
+int stats_option(int *, char **);
+
+/* prototypes for functions in perfctr.c */
+
+/* the regions with hardware counters round them */
+#define PERF_FAT_DECODE   0
+#define PERF_TRAVERSE     1
+#define PERF_COPY_IN      2
+#define PERF_FINDORPHANS  3
+#define PERF_NREGIONS     4
+
+#define PERF_NCOUNTERS    4     /* cycles, instructions, LLC and branch misses */
+
+/* where a region started */
+struct perf_mark {
+    int on;
+    uint64_t ns;
+    uint64_t counts[PERF_NCOUNTERS];
+};
+
+void perf_enable(void);
+void perf_begin(struct perf_mark *);
+void perf_end(int, struct perf_mark *, uint64_t);
+void perf_save(FILE *);
+int perf_load(char *);
+void perf_print(FILE *);
 
-uint8_t *root_dir_addr(uint8_t *, struct bpb33 *);
+/* prototypes for functions in fat12.c */
 
-uint8_t *cluster_to_addr(uint16_t, uint8_t *, struct bpb33 *);
+void fat12_unpack(const uint8_t *, uint16_t *, uint32_t, uint32_t);
+void fat12_pack(uint8_t *, const uint16_t *, uint32_t, uint32_t);
+const char *fat12_kernel_name(void);
 
 #endif // __DOS_H__
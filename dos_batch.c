@@ -0,0 +1,197 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_batch runs a script of dos_ls/dos_cat/dos_cp style commands
+   against one disk image, which is mapped, checked and has its FAT
+   decoded just once, and is synced back to disk just once at the end.
+   One command per line:
+
+       ls [<path>]
+       cat <path> [<offset> <length>]
+       stat <path>
+       cp-out <path> <filename>
+       cp-in <filename> <path>
+
+   Image paths may have an "a:" prefix or not.  Blank lines and lines
+   starting with '#' are ignored.  A command that fails is reported,
+   and the rest of the script still runs. */
+
+#define MAXARGS 4
+#define MAXLINE 1024
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s <imagename> [<scriptfile>]\n", progname);
+    fprintf(stderr, "\truns the commands in scriptfile (or on stdin) against the image\n");
+    exit(1);
+}
+
+
+/* skip the optional volume name on a path in the image */
+char *image_path(char *path)
+{
+    if (strncmp("a:", path, 2) == 0)
+	path += 2;
+    return path;
+}
+
+
+/* do_stat prints what the directory entry for a file says about it,
+   and how its cluster chain is laid out */
+int do_stat(char *path, struct fat_volume *vol)
+{
+    struct direntry *dirent;
+    struct extent *ext;
+    char name[MAXFILENAME];
+    int nextents, e, nclusters = 0;
+
+    dirent = find_path(image_path(path), vol);
+    if (dirent == NULL)
+    {
+	fprintf(stderr, "No file called %s exists in the disk image\n", path);
+	return -1;
+    }
+
+    get_dirent(dirent, name);
+    nextents = chain_extents(getushort(dirent->deStartCluster), &ext, vol);
+    for (e = 0; e < nextents; e++)
+	nclusters += ext[e].count;
+    free(ext);
+
+    printf("%s: %u bytes, starting cluster %d, %d clusters in %d extents, %c%c%c%c%c\n",
+	   name, getulong(dirent->deFileSize),
+	   getushort(dirent->deStartCluster), nclusters, nextents,
+	   (dirent->deAttributes & ATTR_DIRECTORY) ? 'd' : ' ',
+	   (dirent->deAttributes & ATTR_READONLY) ? 'r' : ' ',
+	   (dirent->deAttributes & ATTR_HIDDEN) ? 'h' : ' ',
+	   (dirent->deAttributes & ATTR_SYSTEM) ? 's' : ' ',
+	   (dirent->deAttributes & ATTR_ARCHIVE) ? 'a' : ' ');
+    return 0;
+}
+
+
+/* do_cat writes a file (or a range of it) to stdout */
+int do_cat(int argc, char **argv, struct fat_volume *vol)
+{
+    struct direntry *dirent;
+
+    dirent = find_path(image_path(argv[1]), vol);
+    if (dirent == NULL)
+    {
+	fprintf(stderr, "No file called %s exists in the disk image\n", argv[1]);
+	return -1;
+    }
+
+    /* anything ls or stat printed has to come out first */
+    fflush(stdout);
+    if (argc == 4)
+	return cat_range(dirent, strtoul(argv[2], NULL, 0),
+			 strtoul(argv[3], NULL, 0), STDOUT_FILENO, vol);
+    return cat_file(dirent, STDOUT_FILENO, vol);
+}
+
+
+/* run_command runs one line of the script, which has already been
+   split into words.  Returns 0 on success, -1 on failure. */
+int run_command(int argc, char **argv, struct fat_volume *vol)
+{
+    char *cmd = argv[0];
+
+    if (strcmp(cmd, "ls") == 0 && argc == 1)
+    {
+	list_volume(stdout, vol);
+	return 0;
+    }
+    if (strcmp(cmd, "ls") == 0 && argc == 2)
+	return list_path(stdout, image_path(argv[1]), vol);
+    if (strcmp(cmd, "cat") == 0 && (argc == 2 || argc == 4))
+	return do_cat(argc, argv, vol);
+    if (strcmp(cmd, "stat") == 0 && argc == 2)
+	return do_stat(argv[1], vol);
+    if (strcmp(cmd, "cp-out") == 0 && argc == 3)
+	return copyout(argv[1], argv[2], vol);
+    if (strcmp(cmd, "cp-in") == 0 && argc == 3)
+	return copyin(argv[1], argv[2], vol);
+
+    fprintf(stderr, "Unknown command or wrong arguments: %s\n", cmd);
+    return -1;
+}
+
+
+int main(int argc, char** argv)
+{
+    struct fat_volume *vol;
+    FILE *script = stdin;
+    char line[MAXLINE];
+    char *args[MAXARGS + 1];
+    int nargs, lineno = 0, failed = 0;
+
+    if (argc < 2 || argc > 3)
+    {
+	usage(argv[0]);
+    }
+
+    if (argc == 3)
+    {
+	script = fopen(argv[2], "r");
+	if (script == NULL)
+	{
+	    fprintf(stderr, "Can't open script %s\n", argv[2]);
+	    exit(1);
+	}
+    }
+
+    vol = open_volume(argv[1]);
+    if (vol == NULL)
+	exit(1);
+
+    while (fgets(line, sizeof(line), script) != NULL)
+    {
+	lineno++;
+
+	/* split the line into words */
+	nargs = 0;
+	args[nargs] = strtok(line, " \t\r\n");
+	while (args[nargs] != NULL && nargs < MAXARGS)
+	    args[++nargs] = strtok(NULL, " \t\r\n");
+	if (nargs == 0 || args[0][0] == '#')
+	    continue;
+	if (args[nargs] != NULL)
+	{
+	    fprintf(stderr, "line %d: too many arguments\n", lineno);
+	    failed++;
+	    continue;
+	}
+
+	if (run_command(nargs, args, vol) < 0)
+	{
+	    fprintf(stderr, "line %d: %s failed\n", lineno, args[0]);
+	    failed++;
+	}
+    }
+    fflush(stdout);
+
+    if (script != stdin)
+	fclose(script);
+
+    /* one sync for the whole script */
+    sync_volume(vol);
+    close_volume(vol);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,626 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <string.h>
+#include <time.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_bench times the core operations on synthetic images made by
+   dos_mkimage: FAT entry reads, a walk of the whole directory tree,
+   path lookups at each depth, copying a file in and out, and scandisk
+   on a clean image and on a damaged one.  Each benchmark is run a
+   number of times, and reported as the median and 99th percentile
+   time per run, and the rate that gives (bytes, entries or lookups a
+   second).
+
+   The results file holds the baseline.  If it's already there, the
+   results in it are read first, and any benchmark whose median has
+   got more than the threshold slower is flagged as a regression, and
+   dos_bench exits with status 1, so `make bench` on two versions of
+   the tree compares them.  The baseline is only written the first
+   time, or when asked for with -s, so a slow run never quietly
+   becomes the thing the next one is measured against.
+
+   dos_bench runs dos_mkimage and scandisk from the directory given
+   with -B (the current directory by default), and works in a
+   temporary directory it removes afterwards.  The timings are only
+   as good as the build: `make bench` uses the same CFLAGS as
+   everything else.
+
+   With -p, the hardware counters (see perfctr.c) are turned on too,
+   here and in scandisk, and what they found in each region over all
+   the runs is printed at the end.  The counters cost a little time of
+   their own, so -p results are only ever compared with -p results:
+   they go in bench-perf.results by default, the results file records
+   which kind it holds, and dos_bench refuses to compare across the
+   two. */
+
+#define MAX_BENCH 32
+#define MAX_DEPTH 8
+#define COPY_SIZE (4 << 20)
+
+struct bench_result {
+    char name[64];
+    double median, p99;         /* nanoseconds per run */
+    double work;                /* done in one run */
+    char unit[16];
+};
+
+struct bench {
+    int reps;
+    int perf;                   /* -p: hardware counters too */
+    char *bindir;
+    char tmpdir[64];
+    struct bench_result results[MAX_BENCH];
+    int nresults;
+};
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-p] [-s] [-n reps] [-t percent] [-B bindir] [-o resultsfile]\n", progname);
+    fprintf(stderr, "\ttimes the core operations, and compares them with the last results\n");
+    exit(1);
+}
+
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* record sorts a benchmark's times and keeps its median and 99th
+   percentile (nearest rank) */
+static void record(struct bench *b, const char *name, double *times,
+		   double work, const char *unit)
+{
+    struct bench_result *r = &b->results[b->nresults++];
+    int n = b->reps, rank;
+
+    qsort(times, n, sizeof(double), cmp_double);
+    rank = (99 * n + 99) / 100;
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    r->median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+    r->p99 = times[rank - 1];
+    r->work = work;
+    snprintf(r->unit, sizeof(r->unit), "%s", unit);
+}
+
+
+/* the tools report the boot sector on stderr as they open an image
+   (with DEBUG); keep that out of the way */
+static struct fat_volume *quiet_open(char *filename)
+{
+    struct fat_volume *vol;
+    int saved = dup(2), null = open("/dev/null", O_WRONLY);
+
+    dup2(null, 2);
+    vol = open_volume(filename);
+    dup2(saved, 2);
+    close(null);
+    close(saved);
+    if (vol == NULL)
+    {
+	fprintf(stderr, "Can't open %s\n", filename);
+	exit(1);
+    }
+    return vol;
+}
+
+/* run runs one of the other tools, with its output thrown away, and
+   returns its exit status */
+static int run(char **argv)
+{
+    int status, null;
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+	null = open("/dev/null", O_WRONLY);
+	dup2(null, 1);
+	dup2(null, 2);
+	execv(argv[0], argv);
+	_exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+	return -1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void copy_file(char *from, char *to)
+{
+    char buf[65536];
+    ssize_t n;
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (in < 0 || out < 0)
+    {
+	fprintf(stderr, "Can't copy %s to %s: %s\n", from, to, strerror(errno));
+	exit(1);
+    }
+    while ((n = read(in, buf, sizeof(buf))) > 0)
+	if (write(out, buf, n) != n)
+	{
+	    fprintf(stderr, "Can't write %s: %s\n", to, strerror(errno));
+	    exit(1);
+	}
+    close(in);
+    close(out);
+}
+
+static char *tmp_path(struct bench *b, const char *name)
+{
+    static char paths[8][128];
+    static int next;
+    char *p = paths[next++ % 8];
+
+    snprintf(p, sizeof(paths[0]), "%s/%s", b->tmpdir, name);
+    return p;
+}
+
+
+/* the directory tree, as walk_dirs finds it: how many entries there
+   are, and the first file at each depth, with its path */
+struct tree {
+    int nentries;
+    int deepest;
+    char names[MAX_DEPTH][MAXFILENAME];
+    char paths[MAX_DEPTH][MAXPATHLEN];
+    int found[MAX_DEPTH];
+};
+
+static uint16_t tree_visit(struct direntry *dirent, int depth, void *arg)
+{
+    struct tree *t = arg;
+    char name[MAXFILENAME];
+    int i;
+
+    t->nentries++;
+    if (dirent->deName[0] == SLOT_EMPTY ||
+	dirent->deName[0] == SLOT_DELETED || dirent->deName[0] == '.' ||
+	(dirent->deAttributes & ATTR_VOLUME) != 0 || depth >= MAX_DEPTH)
+	return 0;
+
+    get_name(name, dirent);
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+    {
+	strcpy(t->names[depth], name);
+	return getushort(dirent->deStartCluster);
+    }
+    if (!t->found[depth])
+    {
+	t->found[depth] = TRUE;
+	t->paths[depth][0] = '\0';
+	for (i = 0; i < depth; i++)
+	{
+	    strcat(t->paths[depth], t->names[i]);
+	    strcat(t->paths[depth], "/");
+	}
+	strcat(t->paths[depth], name);
+	if (depth > t->deepest)
+	    t->deepest = depth;
+    }
+    return 0;
+}
+
+
+/* the benchmarks that work on an open image */
+static void bench_volume(struct bench *b, char *label, char *image)
+{
+    struct fat_volume *vol = quiet_open(image);
+    double *times = malloc(b->reps * sizeof(double)), start;
+    char name[64];
+    struct tree t;
+    uint32_t c, n, sum = 0;
+    int rep, pass, d, i;
+
+    /* FAT entry reads: every cluster, a hundred times over */
+    n = vol->nclusters < vol->max_cluster ? vol->nclusters : vol->max_cluster;
+    for (rep = -1; rep < b->reps; rep++)
+    {
+	start = now_ns();
+	for (pass = 0; pass < 100; pass++)
+	    for (c = CLUST_FIRST; c < n; c++)
+		sum += get_fat_entry(c, vol);
+	if (rep >= 0)
+	    times[rep] = now_ns() - start;
+    }
+    snprintf(name, sizeof(name), "fat_get/%s", label);
+    record(b, name, times, 100.0 * (n - CLUST_FIRST), "entries");
+
+    /* the whole directory tree */
+    for (rep = -1; rep < b->reps; rep++)
+    {
+	memset(&t, 0, sizeof(t));
+	start = now_ns();
+	walk_dirs(MSDOSFSROOT, 0, tree_visit, &t, vol);
+	if (rep >= 0)
+	    times[rep] = now_ns() - start;
+    }
+    snprintf(name, sizeof(name), "traverse/%s", label);
+    record(b, name, times, t.nentries, "entries");
+
+    /* a thousand lookups of a file at each depth */
+    for (d = 0; d <= t.deepest; d++)
+    {
+	if (!t.found[d])
+	    continue;
+	for (rep = -1; rep < b->reps; rep++)
+	{
+	    start = now_ns();
+	    for (i = 0; i < 1000; i++)
+		if (find_file(t.paths[d], 0, FIND_FILE, vol) == NULL)
+		{
+		    fprintf(stderr, "Lookup of %s failed\n", t.paths[d]);
+		    exit(1);
+		}
+	    if (rep >= 0)
+		times[rep] = now_ns() - start;
+	}
+	snprintf(name, sizeof(name), "lookup/depth%d/%s", d, label);
+	record(b, name, times, 1000, "lookups");
+    }
+
+    if (sum == 1)                       /* keep the reads */
+	printf(" ");
+    free(times);
+    close_volume(vol);
+}
+
+/* copying a file in, to a fresh copy of the image each time, then
+   copying it back out again */
+static void bench_copy(struct bench *b, char *label, char *image)
+{
+    struct fat_volume *vol;
+    double *times = malloc(b->reps * sizeof(double)), start;
+    char *work = tmp_path(b, "work.img"), *in = tmp_path(b, "copy.in");
+    char *out = tmp_path(b, "copy.out"), name[64];
+    uint8_t *data = malloc(COPY_SIZE);
+    uint64_t x = 1;
+    int fd, rep, i;
+
+    for (i = 0; i < COPY_SIZE; i++)
+    {
+	x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+	data[i] = x >> 56;
+    }
+    fd = open(in, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || write(fd, data, COPY_SIZE) != COPY_SIZE)
+    {
+	fprintf(stderr, "Can't write %s\n", in);
+	exit(1);
+    }
+    close(fd);
+    free(data);
+
+    for (rep = -1; rep < b->reps; rep++)
+    {
+	copy_file(image, work);
+	vol = quiet_open(work);
+	start = now_ns();
+	if (copyin(in, "a:/BENCH.DAT", vol) < 0)
+	{
+	    fprintf(stderr, "Copy in to %s failed\n", image);
+	    exit(1);
+	}
+	sync_volume(vol);
+	if (rep >= 0)
+	    times[rep] = now_ns() - start;
+	close_volume(vol);
+    }
+    snprintf(name, sizeof(name), "copyin/%s", label);
+    record(b, name, times, COPY_SIZE, "B");
+
+    vol = quiet_open(work);
+    for (rep = -1; rep < b->reps; rep++)
+    {
+	start = now_ns();
+	if (copyout("a:/BENCH.DAT", out, vol) < 0)
+	    exit(1);
+	if (rep >= 0)
+	    times[rep] = now_ns() - start;
+    }
+    close_volume(vol);
+    snprintf(name, sizeof(name), "copyout/%s", label);
+    record(b, name, times, COPY_SIZE, "B");
+
+    unlink(in);
+    unlink(out);
+    free(times);
+}
+
+/* damage makes a copy of an image with a little of everything
+   scandisk fixes: chains that run into other chains or loop, chains
+   cut short, and clusters nothing refers to */
+static void damage(char *image, char *damaged)
+{
+    struct fat_volume *vol;
+    uint16_t c, v;
+
+    copy_file(image, damaged);
+    vol = quiet_open(damaged);
+    for (c = CLUST_FIRST; c < vol->nclusters && c < vol->max_cluster; c++)
+    {
+	v = get_fat_entry(c, vol);
+	if (v >= CLUST_FIRST && v < (CLUST_EOFS & FAT12_MASK) && c % 37 == 0)
+	    set_fat_entry(c, c > 40 ? c - 30 : c + 30, vol);
+	else if (v >= CLUST_FIRST && c % 71 == 0)
+	    set_fat_entry(c, CLUST_FREE, vol);
+	else if (v == CLUST_FREE && c % 53 == 0)
+	    set_fat_entry(c, FAT12_MASK & CLUST_EOFS, vol);
+    }
+    close_volume(vol);
+}
+
+/* scandisk, start to finish, on a fresh copy each time */
+static void bench_scandisk(struct bench *b, char *label, char *image,
+			   char *kind)
+{
+    double *times = malloc(b->reps * sizeof(double)), start;
+    char scandisk[MAXPATHLEN], *work = tmp_path(b, "scan.img"), name[64];
+    char *argv[] = { scandisk, work, NULL };
+    char *perf = tmp_path(b, "scan.perf");
+    struct stat st;
+    int rep;
+
+    snprintf(scandisk, sizeof(scandisk), "%s/scandisk", b->bindir);
+    if (b->perf)
+	setenv("DOS_PERF", perf, 1);
+    for (rep = -1; rep < b->reps; rep++)
+    {
+	copy_file(image, work);
+	start = now_ns();
+	if (run(argv) != 0)
+	{
+	    fprintf(stderr, "%s failed on %s\n", scandisk, image);
+	    exit(1);
+	}
+	if (rep >= 0)
+	    times[rep] = now_ns() - start;
+	if (rep >= 0 && b->perf)
+	    perf_load(perf);
+	unlink(perf);
+    }
+    unsetenv("DOS_PERF");
+    stat(image, &st);
+    snprintf(name, sizeof(name), "scandisk/%s/%s", kind, label);
+    record(b, name, times, st.st_size, "B");
+    free(times);
+}
+
+
+/* make_image runs dos_mkimage with the given options */
+static char *make_image(struct bench *b, char *name, char *options)
+{
+    char mkimage[MAXPATHLEN], opts[256], *argv[32], *image, *p;
+    int argc = 0;
+
+    snprintf(mkimage, sizeof(mkimage), "%s/dos_mkimage", b->bindir);
+    snprintf(opts, sizeof(opts), "%s", options);
+    image = strdup(tmp_path(b, name));
+    argv[argc++] = mkimage;
+    for (p = strtok(opts, " "); p != NULL; p = strtok(NULL, " "))
+	argv[argc++] = p;
+    argv[argc++] = image;
+    argv[argc] = NULL;
+    if (run(argv) != 0)
+    {
+	fprintf(stderr, "%s %s failed\n", mkimage, options);
+	exit(1);
+    }
+    return image;
+}
+
+
+/* read_results reads a results file, returning how many results it
+   held, or -1 if there isn't one, and whether they were taken with
+   the hardware counters on in *perf */
+static int read_results(char *filename, struct bench_result *results,
+			int *perf)
+{
+    FILE *f = fopen(filename, "r");
+    char line[256];
+    int n = 0;
+
+    *perf = FALSE;
+    if (f == NULL)
+	return -1;
+    while (n < MAX_BENCH && fgets(line, sizeof(line), f) != NULL)
+    {
+	struct bench_result *r = &results[n];
+	if (strcmp(line, "# mode perf\n") == 0)
+	    *perf = TRUE;
+	if (line[0] == '#')
+	    continue;
+	if (sscanf(line, "%63s %lf %lf %lf %15s", r->name, &r->median,
+		   &r->p99, &r->work, r->unit) == 5)
+	    n++;
+    }
+    fclose(f);
+    return n;
+}
+
+static void write_results(char *filename, struct bench *b)
+{
+    FILE *f = fopen(filename, "w");
+    int i;
+
+    if (f == NULL)
+    {
+	fprintf(stderr, "Can't write %s: %s\n", filename, strerror(errno));
+	exit(1);
+    }
+    fprintf(f, "# dos_bench, %d runs each: name median_ns p99_ns work_per_run unit\n",
+	    b->reps);
+    fprintf(f, "# mode %s\n", b->perf ? "perf" : "plain");
+    for (i = 0; i < b->nresults; i++)
+	fprintf(f, "%s %.0f %.0f %.0f %s\n", b->results[i].name,
+		b->results[i].median, b->results[i].p99, b->results[i].work,
+		b->results[i].unit);
+    fclose(f);
+}
+
+static void print_time(double ns)
+{
+    if (ns >= 1e9)
+	printf(" %9.3fs ", ns / 1e9);
+    else if (ns >= 1e6)
+	printf(" %9.3fms", ns / 1e6);
+    else
+	printf(" %9.3fus", ns / 1e3);
+}
+
+/* report prints the results, against the last ones where there are
+   any, and returns how many got slower than the threshold */
+static int report(struct bench *b, struct bench_result *last, int nlast,
+		  double threshold)
+{
+    int i, j, regressions = 0;
+    double rate, change;
+
+    printf("%-28s %11s %11s %16s\n", "benchmark", "median", "p99", "rate");
+    for (i = 0; i < b->nresults; i++)
+    {
+	struct bench_result *r = &b->results[i];
+	rate = r->work / (r->median / 1e9);
+	printf("%-28s", r->name);
+	print_time(r->median);
+	print_time(r->p99);
+	if (rate >= 1e6)
+	    printf(" %8.1fM %s/s", rate / 1e6, r->unit);
+	else
+	    printf(" %8.1fk %s/s", rate / 1e3, r->unit);
+
+	for (j = 0; j < nlast; j++)
+	    if (strcmp(last[j].name, r->name) == 0)
+		break;
+	if (j < nlast && last[j].median > 0)
+	{
+	    change = 100.0 * (r->median - last[j].median) / last[j].median;
+	    printf("  %+6.1f%%", change);
+	    if (change > threshold)
+	    {
+		printf("  REGRESSION");
+		regressions++;
+	    }
+	}
+	printf("\n");
+    }
+    return regressions;
+}
+
+
+int main(int argc, char** argv)
+{
+    struct bench b;
+    struct bench_result last[MAX_BENCH];
+    char *results = NULL, *floppy, *big, *damaged;
+    double threshold = 10;
+    int opt, nlast, last_perf, regressions, save = FALSE;
+
+    memset(&b, 0, sizeof(b));
+    b.reps = 15;
+    b.bindir = ".";
+    while ((opt = getopt(argc, argv, "psn:t:B:o:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'p': b.perf = TRUE; break;
+	case 's': save = TRUE; break;
+	case 'n': b.reps = atoi(optarg); break;
+	case 't': threshold = atof(optarg); break;
+	case 'B': b.bindir = optarg; break;
+	case 'o': results = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (optind != argc || b.reps < 1)
+	usage(argv[0]);
+    if (results == NULL)
+	results = b.perf ? "bench-perf.results" : "bench.results";
+
+    strcpy(b.tmpdir, "/tmp/dos_bench.XXXXXX");
+    if (mkdtemp(b.tmpdir) == NULL)
+    {
+	fprintf(stderr, "Can't make a temporary directory: %s\n", strerror(errno));
+	exit(1);
+    }
+    nlast = read_results(results, last, &last_perf);
+    if (nlast >= 0 && last_perf != b.perf)
+    {
+	fprintf(stderr, "%s was taken %s -p, so it can't be compared with this run\n",
+		results, last_perf ? "with" : "without");
+	rmdir(b.tmpdir);
+	exit(1);
+    }
+    if (b.perf)
+	perf_enable();
+
+    /* a full floppy, and a 32MB image with room to spare */
+    floppy = make_image(&b, "floppy.img",
+			"-n 300 -d 3 -w 3 -s 0:8000 -F 20 -x 10 -r 1");
+    big = make_image(&b, "big.img",
+		     "-S 65535 -n 800 -d 3 -w 4 -s 0:40000 -F 20 -x 10 -r 2");
+
+    bench_volume(&b, "floppy", floppy);
+    bench_volume(&b, "big", big);
+    bench_copy(&b, "big", big);
+    bench_scandisk(&b, "floppy", floppy, "clean");
+    bench_scandisk(&b, "big", big, "clean");
+    damaged = strdup(tmp_path(&b, "damaged.img"));
+    damage(floppy, damaged);
+    bench_scandisk(&b, "floppy", damaged, "damaged");
+    damage(big, damaged);
+    bench_scandisk(&b, "big", damaged, "damaged");
+
+    regressions = report(&b, last, nlast, threshold);
+    if (nlast > 0)
+	printf("%d regression%s against the baseline (more than %.0f%% slower)\n",
+	       regressions, regressions == 1 ? "" : "s", threshold);
+    if (save || nlast < 0)
+    {
+	write_results(results, &b);
+	printf("Baseline written to %s\n", results);
+    }
+    else
+	printf("Baseline in %s kept (-s to replace it)\n", results);
+    if (b.perf)
+    {
+	printf("\n");
+	perf_print(stdout);
+    }
+
+    unlink(floppy);
+    unlink(big);
+    unlink(damaged);
+    unlink(tmp_path(&b, "work.img"));
+    unlink(tmp_path(&b, "scan.img"));
+    rmdir(b.tmpdir);
+    free(floppy);
+    free(big);
+    free(damaged);
+    return regressions > 0;
+}
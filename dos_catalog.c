@@ -0,0 +1,51 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_catalog creates (or refreshes) the path catalog for an image,
+   <imagename>.cat, which the other tools then use for lookups and
+   keep up to date themselves - see catalog.c */
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct fat_volume *vol;
+    int was_ok;
+
+    if (argc != 2)
+    {
+	usage(argv[0]);
+    }
+
+    vol = open_volume(argv[1]);
+    if (vol == NULL)
+	exit(1);
+
+    was_ok = vol->catalog_ok;
+    if (catalog_write(vol) < 0)
+	exit(1);
+    printf("%s %s\n", was_ok ? "Refreshed" : "Wrote", vol->catalog_path);
+
+    close_volume(vol);
+
+    return 0;
+}
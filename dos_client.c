@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <limits.h>
+
+#include "dosproto.h"
+
+
+/* dos_client sends one request to a dos_server, and prints the
+   reply: the dos_ls, dos_cat and dos_cp equivalents for a long-lived
+   server, and a reference for the protocol in dosproto.h */
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s <socketpath> ls <imagename> [<directory>]\n", progname);
+    fprintf(stderr, "       %s <socketpath> cat <imagename> <filename> [<offset> <length>]\n", progname);
+    fprintf(stderr, "       %s <socketpath> stat <imagename> <filename>\n", progname);
+    fprintf(stderr, "       %s <socketpath> put <imagename> <hostfile> <filename>\n", progname);
+    exit(1);
+}
+
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = write(fd, buf, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return 0;
+	buf = (const char *)buf + n;
+	len -= n;
+    }
+    return 1;
+}
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = read(fd, buf, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return 0;
+	buf = (char *)buf + n;
+	len -= n;
+    }
+    return 1;
+}
+
+
+/* slurp reads the whole of a file into memory */
+static char *slurp(char *filename, uint32_t *len)
+{
+    char *buf = NULL;
+    size_t size = 0, got = 0;
+    ssize_t n;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+	fprintf(stderr, "Can't open file %s to copy data in\n", filename);
+	exit(1);
+    }
+    while (1)
+    {
+	if (got == size)
+	{
+	    size = size ? 2 * size : 65536;
+	    buf = realloc(buf, size);
+	}
+	n = read(fd, buf + got, size - got);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	got += n;
+    }
+    close(fd);
+    *len = got;
+    return buf;
+}
+
+
+int main(int argc, char** argv)
+{
+    struct sockaddr_un addr;
+    struct dos_request req;
+    struct dos_reply reply;
+    struct dos_stat st;
+    char image[PATH_MAX], buf[65536];
+    char *path = "", *data = NULL;
+    uint32_t n;
+    int fd;
+
+    if (argc < 4)
+	usage(argv[0]);
+
+    memset(&req, 0, sizeof(req));
+    req.magic = DOSP_MAGIC;
+    if (strcmp(argv[2], "ls") == 0 && (argc == 4 || argc == 5))
+    {
+	req.op = DOSP_LIST;
+	if (argc == 5)
+	    path = argv[4];
+    }
+    else if (strcmp(argv[2], "cat") == 0 && (argc == 5 || argc == 7))
+    {
+	req.op = DOSP_READ;
+	path = argv[4];
+	req.length = 0xffffffff;
+	if (argc == 7)
+	{
+	    req.offset = strtoul(argv[5], NULL, 0);
+	    req.length = strtoul(argv[6], NULL, 0);
+	}
+    }
+    else if (strcmp(argv[2], "stat") == 0 && argc == 5)
+    {
+	req.op = DOSP_STAT;
+	path = argv[4];
+    }
+    else if (strcmp(argv[2], "put") == 0 && argc == 6)
+    {
+	req.op = DOSP_WRITE;
+	path = argv[5];
+	data = slurp(argv[4], &req.length);
+    }
+    else
+	usage(argv[0]);
+
+    /* the server has its own working directory */
+    if (realpath(argv[3], image) == NULL)
+    {
+	fprintf(stderr, "Cannot read disk image file %s:\n%s\n",
+		argv[3], strerror(errno));
+	exit(1);
+    }
+    req.image_len = strlen(image);
+    req.path_len = strlen(path);
+    if (req.image_len > DOSP_MAXNAME || req.path_len > DOSP_MAXNAME)
+    {
+	fprintf(stderr, "Filename too long\n");
+	exit(1);
+    }
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+	fprintf(stderr, "Can't connect to %s: %s\n", argv[1], strerror(errno));
+	exit(1);
+    }
+
+    if (!write_all(fd, &req, sizeof(req)) ||
+	!write_all(fd, image, req.image_len) ||
+	!write_all(fd, path, req.path_len) ||
+	(data != NULL && !write_all(fd, data, req.length)) ||
+	!read_all(fd, &reply, sizeof(reply)))
+    {
+	fprintf(stderr, "Lost the connection to the server\n");
+	exit(1);
+    }
+    if (reply.status != 0)
+    {
+	fprintf(stderr, "%s: %s\n", argv[2], strerror(-reply.status));
+	exit(1);
+    }
+
+    if (req.op == DOSP_STAT)
+    {
+	if (reply.length != sizeof(st) || !read_all(fd, &st, sizeof(st)))
+	    exit(1);
+	printf("%u bytes, starting cluster %d, %u clusters in %u extents, attributes 0x%02x\n",
+	       st.size, st.start_cluster, st.nclusters, st.nextents,
+	       st.attributes);
+    }
+    else
+    {
+	/* the listing or the file's contents */
+	while (reply.length > 0)
+	{
+	    n = reply.length < sizeof(buf) ? reply.length : sizeof(buf);
+	    if (!read_all(fd, buf, n) || !write_all(STDOUT_FILENO, buf, n))
+		exit(1);
+	    reply.length -= n;
+	}
+    }
+
+    close(fd);
+    free(data);
+    return 0;
+}
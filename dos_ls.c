@@ -15,173 +15,34 @@
 #include "dos.h"
 
 
-void print_indent(int indent)
-{
-    int i;
-    for (i = 0; i < indent*4; i++)
-	printf(" ");
-}
-
-
-uint16_t print_dirent(struct direntry *dirent, int indent)
-{
-    uint16_t followclust = 0;
-
-    int i;
-    char name[9];
-    char extension[4];
-    uint32_t size;
-    uint16_t file_cluster;
-    name[8] = ' ';
-    extension[3] = ' ';
-    memcpy(name, &(dirent->deName[0]), 8);
-    memcpy(extension, dirent->deExtension, 3);
-    if (name[0] == SLOT_EMPTY)
-    {
-	return followclust;
-    }
-
-    /* skip over deleted entries */
-    if (((uint8_t)name[0]) == SLOT_DELETED)
-    {
-	return followclust;
-    }
-
-    if (((uint8_t)name[0]) == 0x2E)
-    {
-	// dot entry ("." or "..")
-	// skip it
-        return followclust;
-    }
-
-    /* names are space padded - remove the spaces */
-    for (i = 8; i > 0; i--) 
-    {
-	if (name[i] == ' ') 
-	    name[i] = '\0';
-	else 
-	    break;
-    }
-
-    /* remove the spaces from extensions */
-    for (i = 3; i > 0; i--) 
-    {
-	if (extension[i] == ' ') 
-	    extension[i] = '\0';
-	else 
-	    break;
-    }
-
-    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
-    {
-	// ignore any long file name extension entries
-	//
-	// printf("Win95 long-filename entry seq 0x%0x\n", dirent->deName[0]);
-    }
-    else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
-    {
-	printf("Volume: %s\n", name);
-    } 
-    else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
-    {
-        // don't deal with hidden directories; MacOS makes these
-        // for trash directories and such; just ignore them.
-	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
-        {
-	    print_indent(indent);
-    	    printf("%s/ (directory)\n", name);
-            file_cluster = getushort(dirent->deStartCluster);
-            followclust = file_cluster;
-        }
-    }
-    else 
-    {
-        /*
-         * a "regular" file entry
-         * print attributes, size, starting cluster, etc.
-         */
-	int ro = (dirent->deAttributes & ATTR_READONLY) == ATTR_READONLY;
-	int hidden = (dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN;
-	int sys = (dirent->deAttributes & ATTR_SYSTEM) == ATTR_SYSTEM;
-	int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
-
-	size = getulong(dirent->deFileSize);
-	print_indent(indent);
-	printf("%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
-	       name, extension, size, getushort(dirent->deStartCluster),
-	       ro?'r':' ', 
-               hidden?'h':' ', 
-               sys?'s':' ', 
-               arch?'a':' ');
-    }
-
-    return followclust;
-}
-
-
-void follow_dir(uint16_t cluster, int indent,
-		uint8_t *image_buf, struct bpb33* bpb)
-{
-    while (is_valid_cluster(cluster, bpb))
-    {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
-	{
-            
-            uint16_t followclust = print_dirent(dirent, indent);
-            if (followclust)
-                follow_dir(followclust, indent+1, image_buf, bpb);
-            dirent++;
-	}
-
-	cluster = get_fat_entry(cluster, image_buf, bpb);
-    }
-}
-
-
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb)
-{
-    uint16_t cluster = 0;
-
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
-    {
-        uint16_t followclust = print_dirent(dirent, 0);
-        if (is_valid_cluster(followclust, bpb))
-            follow_dir(followclust, 1, image_buf, bpb);
-
-        dirent++;
-    }
-}
-
-
 void usage(char *progname)
 {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [--stats[=json]] <imagename> [<directory>]\n", progname);
     exit(1);
 }
 
 
 int main(int argc, char** argv)
 {
-    uint8_t *image_buf;
-    int fd;
-    struct bpb33* bpb;
-    if (argc != 2)
+    struct fat_volume *vol;
+    stats_option(&argc, argv);
+    if (argc != 2 && argc != 3)
     {
 	usage(argv[0]);
     }
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-    traverse_root(image_buf, bpb);
+    vol = open_volume(argv[1]);
+    if (vol == NULL)
+	exit(1);
+    if (argc == 3)
+    {
+	if (list_path(stdout, argv[2], vol) < 0)
+	    exit(1);
+    }
+    else
+	list_volume(stdout, vol);
 
-    unmmap_file(image_buf, &fd);
+    close_volume(vol);
 
     return 0;
 }
@@ -0,0 +1,428 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <math.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* dos_mkimage writes a new FAT-12 disk image full of synthetic files,
+   for measuring the other tools against inputs bigger and messier than
+   the ones in the repository.  Everything about the image comes from
+   the options, and the same options (seed included) always give the
+   same image, byte for byte:
+
+       -S sectors    size of the image, in 512 byte sectors, up to
+                     65535 (default 2880, a 1.44MB floppy); clusters
+                     are as small as FAT-12 allows
+       -R entries    root directory entries (default 224)
+       -n files      how many files (default 100)
+       -d depth      how deep the directory tree goes (default 2)
+       -w fanout     subdirectories in each directory (default 3)
+       -s min:max    file sizes in bytes, spread evenly on a log scale
+                     (default 0:65536)
+       -F percent    fragmentation: the chance each cluster of a file
+                     after the first isn't the one right after the
+                     previous one (default 0)
+       -x percent    the share of files that are created and then
+                     deleted, leaving deleted entries behind and their
+                     clusters free for later files (default 0)
+       -r seed       (default 1)
+
+   Files are spread at random over the root and every directory in the
+   tree, and hold pseudo-random bytes. */
+
+#define BYTES_PER_SECTOR 512
+#define MAX_FAT12_CLUSTERS 4084
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-S sectors] [-R rootentries] [-n files] [-d depth] [-w fanout]\n", progname);
+    fprintf(stderr, "       [-s minsize:maxsize] [-F fragpercent] [-x deletedpercent] [-r seed] <imagename>\n");
+    exit(1);
+}
+
+
+/* a small, fast generator, so images don't depend on the C library's
+   rand() */
+static uint64_t next_random(uint64_t *state)
+{
+    uint64_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+/* a random number in [0, n) */
+static uint32_t random_below(uint64_t *state, uint32_t n)
+{
+    return n ? (uint32_t)(next_random(state) % n) : 0;
+}
+
+
+struct gen_dir {
+    uint16_t cluster;           /* first cluster, MSDOSFSROOT for the root */
+    int parent;                 /* index of the parent directory */
+    int nslots, used;           /* entries it has room for, and has */
+    uint16_t *clusters;         /* its chain, to find slot i in */
+};
+
+struct generator {
+    struct fat_volume *vol;
+    uint64_t random;
+    int fragmentation;          /* percent */
+    uint16_t cursor;            /* where contiguous allocation carries on */
+    uint32_t limit;             /* clusters the tools count as valid */
+    struct gen_dir *dirs;
+    int ndirs;
+};
+
+
+/* make_blank writes an empty FAT-12 image of the given size */
+static void make_blank(char *filename, uint32_t sectors, uint32_t rootents)
+{
+    struct bootsector33 *boot;
+    struct byte_bpb33 *bpb;
+    uint32_t bytespersec = BYTES_PER_SECTOR;
+    uint32_t secperclust = 1, fatsecs = 1, rootsecs, clusters, prev;
+    uint8_t *buf;
+    int fd, i;
+
+    rootsecs = (rootents * sizeof(struct direntry) + BYTES_PER_SECTOR - 1)
+	/ BYTES_PER_SECTOR;
+
+    /* the smallest clusters FAT-12 can count, then a FAT big enough
+       for them */
+    while (sectors / secperclust > MAX_FAT12_CLUSTERS)
+	secperclust *= 2;
+    do
+    {
+	prev = fatsecs;
+	clusters = (sectors - 1 - 2 * fatsecs - rootsecs) / secperclust;
+	fatsecs = ((clusters + CLUST_FIRST) * 3 / 2 + BYTES_PER_SECTOR - 1)
+	    / BYTES_PER_SECTOR;
+    } while (fatsecs != prev);
+
+    buf = calloc(sectors, BYTES_PER_SECTOR);
+    boot = (struct bootsector33 *)buf;
+    boot->bsJump[0] = 0xeb;
+    boot->bsJump[1] = 0x3c;
+    boot->bsJump[2] = 0x90;
+    memcpy(boot->bsOemName, "dosmkimg", 8);
+    bpb = (struct byte_bpb33 *)boot->bsBPB;
+    putushort(bpb->bpbBytesPerSec, bytespersec);
+    bpb->bpbSecPerClust = secperclust;
+    putushort(bpb->bpbResSectors, 1);
+    bpb->bpbFATs = 2;
+    putushort(bpb->bpbRootDirEnts, rootents);
+    putushort(bpb->bpbSectors, sectors);
+    bpb->bpbMedia = 0xf0;
+    putushort(bpb->bpbFATsecs, fatsecs);
+    putushort(bpb->bpbSecPerTrack, 18);
+    putushort(bpb->bpbHeads, 2);
+    boot->bsBootSectSig0 = BOOTSIG0;
+    boot->bsBootSectSig1 = BOOTSIG1;
+
+    /* the two reserved FAT entries, in both FATs */
+    for (i = 0; i < 2; i++)
+    {
+	uint8_t *fat = buf + BYTES_PER_SECTOR * (1 + i * fatsecs);
+	fat[0] = 0xf0;
+	fat[1] = 0xff;
+	fat[2] = 0xff;
+    }
+
+    fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0 || write(fd, buf, sectors * BYTES_PER_SECTOR)
+	!= sectors * BYTES_PER_SECTOR)
+    {
+	fprintf(stderr, "Can't write %s: %s\n", filename, strerror(errno));
+	exit(1);
+    }
+    close(fd);
+    free(buf);
+}
+
+
+/* next_free finds the first free cluster at or after cluster,
+   wrapping round, or 0 if there are none */
+static uint16_t next_free(struct generator *gen, uint16_t cluster)
+{
+    uint32_t i;
+
+    if (cluster < CLUST_FIRST || cluster >= gen->limit)
+	cluster = CLUST_FIRST;
+    for (i = CLUST_FIRST; i < gen->limit; i++)
+    {
+	if (get_fat_entry(cluster, gen->vol) == CLUST_FREE)
+	    return cluster;
+	if (++cluster >= gen->limit)
+	    cluster = CLUST_FIRST;
+    }
+    return 0;
+}
+
+/* alloc_after allocates a cluster to follow prev (or to start a new
+   chain, if prev is 0): usually the next free one along, but with the
+   fragmentation setting's chance, one somewhere else entirely */
+static uint16_t alloc_after(struct generator *gen, uint16_t prev)
+{
+    struct fat_volume *vol = gen->vol;
+    uint16_t cluster;
+
+    if (prev != 0 && random_below(&gen->random, 100) < gen->fragmentation)
+	cluster = next_free(gen, CLUST_FIRST + random_below(&gen->random,
+				gen->limit - CLUST_FIRST));
+    else
+	cluster = next_free(gen, prev ? prev + 1 : gen->cursor);
+    if (cluster == 0)
+    {
+	fprintf(stderr, "No more space in filesystem\n");
+	exit(1);
+    }
+
+    set_fat_entry(cluster, FAT12_MASK & CLUST_EOFS, vol);
+    if (prev != 0)
+	set_fat_entry(prev, cluster, vol);
+    gen->cursor = cluster + 1;
+    return cluster;
+}
+
+
+/* dir_slot finds slot i of a directory */
+static struct direntry *dir_slot(struct generator *gen, struct gen_dir *dir,
+				 int i)
+{
+    struct fat_volume *vol = gen->vol;
+    int per_cluster = vol->bytes_per_cluster / sizeof(struct direntry);
+
+    if (dir->cluster == MSDOSFSROOT)
+	return (struct direntry *)root_dir_addr(vol) + i;
+    return (struct direntry *)cluster_to_addr(dir->clusters[i / per_cluster],
+					      vol) + i % per_cluster;
+}
+
+/* name_entry fills in a directory's entry with a name with no
+   extension, as write_dirent would always give it one */
+static void name_entry(struct direntry *dirent, const char *name,
+		       uint8_t attributes, uint16_t cluster)
+{
+    memset(dirent, 0, sizeof(struct direntry));
+    memset(dirent->deName, ' ', 8);
+    memset(dirent->deExtension, ' ', 3);
+    memcpy(dirent->deName, name, strlen(name) > 8 ? 8 : strlen(name));
+    dirent->deAttributes = attributes;
+    putushort(dirent->deStartCluster, cluster);
+}
+
+
+/* add_file writes a file of size bytes into directory d */
+static void add_file(struct generator *gen, int d, int n, uint32_t size,
+		     int deleted)
+{
+    struct fat_volume *vol = gen->vol;
+    struct gen_dir *dir = &gen->dirs[d];
+    struct direntry *dirent;
+    uint64_t fill = 0x9e3779b97f4a7c15ULL * (n + 1);
+    uint16_t start = 0, cluster = 0;
+    uint32_t done, i;
+    uint8_t *p;
+    char name[16];
+
+    for (done = 0; done < size; done += vol->bytes_per_cluster)
+    {
+	cluster = alloc_after(gen, cluster);
+	if (start == 0)
+	    start = cluster;
+	p = cluster_to_addr(cluster, vol);
+	for (i = 0; i < vol->bytes_per_cluster; i += 8)
+	{
+	    uint64_t w = next_random(&fill);
+	    memcpy(p + i, &w, 8);
+	}
+	if (size - done < vol->bytes_per_cluster)
+	    memset(p + size - done, 0, vol->bytes_per_cluster - (size - done));
+    }
+
+    sprintf(name, "F%d.DAT", n);
+    dirent = dir_slot(gen, dir, dir->used++);
+    write_dirent(dirent, name, start, size);
+    dirent->deAttributes = ATTR_ARCHIVE;
+    if (deleted)
+    {
+	dirent->deName[0] = SLOT_DELETED;
+	if (start != 0)
+	    free_chain(start, vol);
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    struct generator gen;
+    struct fat_volume *vol;
+    uint32_t sectors = 2880, rootents = 224, minsize = 0, maxsize = 65536;
+    int nfiles = 100, depth = 2, fanout = 3, deleted = 0, ndeleted = 0;
+    int per_cluster, *file_dir, d, i, k, opt;
+    uint32_t *file_size;
+    uint64_t seed = 1;
+    double lo, hi;
+
+    memset(&gen, 0, sizeof(gen));
+    while ((opt = getopt(argc, argv, "S:R:n:d:w:s:F:x:r:")) != -1)
+    {
+	switch (opt)
+	{
+	case 'S': sectors = strtoul(optarg, NULL, 0); break;
+	case 'R': rootents = strtoul(optarg, NULL, 0); break;
+	case 'n': nfiles = atoi(optarg); break;
+	case 'd': depth = atoi(optarg); break;
+	case 'w': fanout = atoi(optarg); break;
+	case 's':
+	    if (sscanf(optarg, "%u:%u", &minsize, &maxsize) != 2)
+		usage(argv[0]);
+	    break;
+	case 'F': gen.fragmentation = atoi(optarg); break;
+	case 'x': deleted = atoi(optarg); break;
+	case 'r': seed = strtoull(optarg, NULL, 0); break;
+	default: usage(argv[0]);
+	}
+    }
+    if (optind != argc - 1 || sectors < 64 || sectors > 65535 ||
+	rootents < 16 || rootents % 16 != 0 || nfiles < 0 || depth < 0 ||
+	fanout < 0 || minsize > maxsize)
+	usage(argv[0]);
+
+    make_blank(argv[optind], sectors, rootents);
+    vol = open_volume(argv[optind]);
+    if (vol == NULL)
+	exit(1);
+    gen.vol = vol;
+    gen.random = seed * 0x9e3779b97f4a7c15ULL + 1;
+    gen.cursor = CLUST_FIRST;
+    gen.limit = vol->nclusters < vol->max_cluster ? vol->nclusters
+	: vol->max_cluster;
+    per_cluster = vol->bytes_per_cluster / sizeof(struct direntry);
+
+    /* the directory tree: the root, then each level in turn */
+    gen.dirs = calloc(1, sizeof(struct gen_dir));
+    gen.dirs[0].cluster = MSDOSFSROOT;
+    gen.dirs[0].nslots = rootents;
+    gen.dirs[0].used = 1;               /* the volume label */
+    gen.ndirs = 1;
+    for (k = 0, i = 0; k < depth; k++)
+    {
+	int first = i, last = gen.ndirs;
+	for (i = first; i < last; i++)
+	{
+	    for (d = 0; d < fanout; d++)
+	    {
+		gen.dirs = realloc(gen.dirs, (gen.ndirs + 1) * sizeof(struct gen_dir));
+		memset(&gen.dirs[gen.ndirs], 0, sizeof(struct gen_dir));
+		gen.dirs[gen.ndirs].parent = i;
+		gen.dirs[gen.ndirs].used = 2;   /* "." and ".." */
+		gen.dirs[i].nslots++;
+		gen.ndirs++;
+	    }
+	}
+    }
+
+    /* which directory each file goes in, and how big it is */
+    file_dir = malloc((nfiles + 1) * sizeof(int));
+    file_size = malloc((nfiles + 1) * sizeof(uint32_t));
+    lo = log(minsize + 1.0);
+    hi = log(maxsize + 1.0);
+    for (i = 0; i < nfiles; i++)
+    {
+	d = random_below(&gen.random, gen.ndirs);
+	if (d == 0 && gen.dirs[0].nslots - (gen.dirs[0].used - 1) - 1 <= 0)
+	    d = gen.ndirs > 1 ? 1 + random_below(&gen.random, gen.ndirs - 1) : 0;
+	file_dir[i] = d;
+	if (d != 0)
+	    gen.dirs[d].nslots++;
+	else
+	    gen.dirs[0].used++;
+	file_size[i] = exp(lo + (hi - lo) * (random_below(&gen.random, 1000000) / 1e6)) - 1;
+	if (file_size[i] > maxsize)
+	    file_size[i] = maxsize;
+    }
+    if (gen.dirs[0].used > gen.dirs[0].nslots)
+    {
+	fprintf(stderr, "Too many files for the root directory - use more directories\n");
+	exit(1);
+    }
+    gen.dirs[0].used = 1;
+
+    /* give every other directory room for its entries, and link it
+       into its parent */
+    name_entry((struct direntry *)root_dir_addr(vol), "SYNTHETI", ATTR_VOLUME, 0);
+    memcpy(((struct direntry *)root_dir_addr(vol))->deExtension, "C  ", 3);
+    for (d = 1; d < gen.ndirs; d++)
+    {
+	struct gen_dir *dir = &gen.dirs[d];
+	struct gen_dir *parent = &gen.dirs[dir->parent];
+	int nclusters = (dir->nslots + 2 + per_cluster) / per_cluster;
+	uint16_t cluster = 0;
+	char name[16];
+
+	dir->clusters = malloc(nclusters * sizeof(uint16_t));
+	for (k = 0; k < nclusters; k++)
+	{
+	    cluster = alloc_after(&gen, cluster);
+	    memset(cluster_to_addr(cluster, vol), 0, vol->bytes_per_cluster);
+	    dir->clusters[k] = cluster;
+	}
+	dir->cluster = dir->clusters[0];
+	dir->nslots = nclusters * per_cluster;
+
+	name_entry(dir_slot(&gen, dir, 0), ".", ATTR_DIRECTORY, dir->cluster);
+	name_entry(dir_slot(&gen, dir, 1), "..", ATTR_DIRECTORY,
+		   parent->cluster);
+	sprintf(name, "D%d", d);
+	name_entry(dir_slot(&gen, parent, parent->used++), name,
+		   ATTR_DIRECTORY, dir->cluster);
+    }
+
+    /* and the files */
+    for (i = 0; i < nfiles; i++)
+    {
+	int gone = random_below(&gen.random, 100) < deleted;
+	add_file(&gen, file_dir[i], i, file_size[i], gone);
+	ndeleted += gone;
+    }
+
+    /* the tools only keep the first FAT up to date; a new image gets
+       both */
+    sync_volume(vol);
+    for (k = 1; k < vol->bpb->bpbFATs; k++)
+	memcpy(vol->image_buf + vol->fat_offset
+	       + k * vol->bpb->bpbFATsecs * vol->bpb->bpbBytesPerSec,
+	       vol->image_buf + vol->fat_offset,
+	       vol->bpb->bpbFATsecs * vol->bpb->bpbBytesPerSec);
+
+    printf("Wrote %s: %u sectors, %u byte clusters, %d directories, %d files (%d deleted), %d clusters free\n",
+	   argv[optind], sectors, vol->bytes_per_cluster, gen.ndirs - 1,
+	   nfiles, ndeleted, count_free_clusters(vol));
+
+    for (d = 0; d < gen.ndirs; d++)
+	free(gen.dirs[d].clusters);
+    free(gen.dirs);
+    free(file_dir);
+    free(file_size);
+    close_volume(vol);
+    return 0;
+}
@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <string.h>
+#include <limits.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+#include "dosproto.h"
+
+
+/* dos_server keeps disk images open - mapped, checked, and with their
+   FATs decoded - and serves list, read, stat and write requests for
+   them over a Unix domain socket (see dosproto.h), so that clients
+   don't pay for starting a process and opening the image every time.
+
+   Each connection gets its own thread.  Up to max_images images are
+   kept open; when another one is wanted, the least recently used one
+   that isn't in use is flushed and closed.  Opening and closing are
+   done without holding the table's lock, so a slow open doesn't hold
+   up requests for the other images; while it's going on the slot is
+   marked loading, and anyone else after the same image (or the one
+   being closed) waits for it.  Each image has a read/write lock: any
+   number of list, read and stat requests can run against it at once,
+   while writes get it to themselves.  Nothing is sent to or taken from
+   a client while an image's lock is held, so a slow client can't hold
+   up anyone else. */
+
+#define DEFAULT_MAX_IMAGES 8
+
+struct served_image {
+    char path[PATH_MAX];        /* real path of the image, "" if unused */
+    struct fat_volume *vol;
+    pthread_rwlock_t lock;      /* shared for reads, exclusive for writes */
+    int users;                  /* requests holding this image */
+    unsigned long last_used;
+    int loading;                /* being opened, outside images_lock */
+    char closing[PATH_MAX];     /* image being closed to make room, if so */
+};
+
+static struct served_image *images;
+static int max_images = DEFAULT_MAX_IMAGES;
+static unsigned long use_clock;
+static pthread_mutex_t images_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t images_loaded = PTHREAD_COND_INITIALIZER;
+static volatile sig_atomic_t stopping;
+
+
+/* get_image returns the open image called name, opening it (and
+   closing the least recently used image to make room, if need be) if
+   it isn't open already.  Returns NULL, with errno set, if it can't. */
+static struct served_image *get_image(char *name)
+{
+    char path[PATH_MAX];
+    struct served_image *img, *victim;
+    struct fat_volume *old, *vol;
+    int i;
+
+    if (realpath(name, path) == NULL)
+	return NULL;
+
+    pthread_mutex_lock(&images_lock);
+    if (stopping)
+    {
+	/* nothing new gets opened once the images are being closed */
+	pthread_mutex_unlock(&images_lock);
+	errno = ESHUTDOWN;
+	return NULL;
+    }
+ retry:
+    img = victim = NULL;
+    for (i = 0; i < max_images; i++)
+    {
+	if (images[i].loading &&
+	    (strcmp(images[i].path, path) == 0 ||
+	     strcmp(images[i].closing, path) == 0))
+	{
+	    /* someone else is opening it, or still closing it */
+	    pthread_cond_wait(&images_loaded, &images_lock);
+	    goto retry;
+	}
+	if (strcmp(images[i].path, path) == 0)
+	{
+	    img = &images[i];
+	    break;
+	}
+	if (images[i].users == 0 && !images[i].loading &&
+	    (victim == NULL || images[i].path[0] == '\0' ||
+	     (victim->path[0] != '\0' &&
+	      images[i].last_used < victim->last_used)))
+	    victim = &images[i];
+    }
+
+    if (img == NULL)
+    {
+	if (victim == NULL)
+	{
+	    /* every open image is busy */
+	    pthread_mutex_unlock(&images_lock);
+	    errno = EBUSY;
+	    return NULL;
+	}
+
+	/* claim the slot, and do the slow part unlocked */
+	old = victim->vol;
+	strcpy(victim->closing, victim->path);
+	strcpy(victim->path, path);
+	victim->vol = NULL;
+	victim->loading = TRUE;
+	pthread_mutex_unlock(&images_lock);
+
+	if (old != NULL)
+	    close_volume(old);
+	vol = open_volume(path);
+
+	pthread_mutex_lock(&images_lock);
+	victim->loading = FALSE;
+	victim->closing[0] = '\0';
+	victim->vol = vol;
+	pthread_cond_broadcast(&images_loaded);
+	if (vol == NULL)
+	{
+	    victim->path[0] = '\0';
+	    pthread_mutex_unlock(&images_lock);
+	    errno = EINVAL;
+	    return NULL;
+	}
+	img = victim;
+    }
+
+    img->users++;
+    img->last_used = ++use_clock;
+    pthread_mutex_unlock(&images_lock);
+    return img;
+}
+
+
+static void put_image(struct served_image *img)
+{
+    pthread_mutex_lock(&images_lock);
+    img->users--;
+    pthread_mutex_unlock(&images_lock);
+}
+
+
+/* read_all and write_all move exactly len bytes, or fail */
+static int read_all(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = read(fd, buf, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return FALSE;
+	buf = (uint8_t *)buf + n;
+	len -= n;
+    }
+    return TRUE;
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	n = write(fd, buf, len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return FALSE;
+	buf = (const uint8_t *)buf + n;
+	len -= n;
+    }
+    return TRUE;
+}
+
+
+static int send_reply(int fd, int32_t status, const void *data, uint32_t len)
+{
+    struct dos_reply reply;
+
+    reply.status = status;
+    reply.length = status == 0 ? len : 0;
+    if (!write_all(fd, &reply, sizeof(reply)))
+	return FALSE;
+    return reply.length == 0 || write_all(fd, data, len);
+}
+
+
+/* chain_bytes is how much of a file's data its cluster chain really
+   holds, which on a damaged image can be less than its size says */
+static uint32_t chain_bytes(struct direntry *dirent, struct fat_volume *vol,
+			    uint32_t *nclusters, int *nextents)
+{
+    struct extent *ext;
+    uint32_t size = getulong(dirent->deFileSize), clusters = 0;
+    int n, e;
+
+    n = chain_extents(getushort(dirent->deStartCluster), &ext, vol);
+    for (e = 0; e < n; e++)
+	clusters += ext[e].count;
+    free(ext);
+
+    if (nclusters)
+	*nclusters = clusters;
+    if (nextents)
+	*nextents = n;
+    if ((uint64_t)clusters * vol->bytes_per_cluster < size)
+	size = clusters * vol->bytes_per_cluster;
+    return size;
+}
+
+
+static int serve_list(int fd, char *path, struct served_image *img)
+{
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *out;
+    int ok, rv;
+
+    out = open_memstream(&buf, &len);
+    if (out == NULL)
+	return send_reply(fd, -errno, NULL, 0);
+    pthread_rwlock_rdlock(&img->lock);
+    rv = list_path(out, path, img->vol) < 0 ? -ENOTDIR : 0;
+    pthread_rwlock_unlock(&img->lock);
+    fclose(out);
+    ok = send_reply(fd, rv, buf, len);
+    free(buf);
+    return ok;
+}
+
+
+/* serve_read copies what was asked for into an anonymous file first,
+   the way serve_write does in reverse, so the image's lock is dropped
+   before any of it goes down the socket */
+static int serve_read(int fd, char *path, uint32_t offset, uint32_t length,
+		      struct served_image *img)
+{
+    struct direntry *dirent;
+    struct dos_reply reply;
+    struct fat_volume *vol = img->vol;
+    struct stat st;
+    uint32_t avail, want = 0;
+    off_t off = 0;
+    ssize_t n;
+    int tmp, rv = 0;
+
+    tmp = memfd_create("dos_server", 0);
+    if (tmp < 0)
+	return send_reply(fd, -errno, NULL, 0);
+
+    pthread_rwlock_rdlock(&img->lock);
+    dirent = find_path(path, vol);
+    if (dirent == NULL)
+	rv = -ENOENT;
+    else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+	rv = -EISDIR;
+    else
+    {
+	avail = chain_bytes(dirent, vol, NULL, NULL);
+	if (offset < avail)
+	    want = avail - offset < length ? avail - offset : length;
+	/* the whole file goes by extent, straight from the image */
+	if (want > 0 && offset == 0 && want == avail)
+	    rv = cat_file(dirent, tmp, vol) < 0 ? -EIO : 0;
+	else if (want > 0)
+	    rv = cat_range(dirent, offset, want, tmp, vol) < 0 ? -EIO : 0;
+    }
+    pthread_rwlock_unlock(&img->lock);
+
+    if (rv == 0 && fstat(tmp, &st) < 0)
+	rv = -errno;
+    if (rv < 0)
+    {
+	close(tmp);
+	return send_reply(fd, rv, NULL, 0);
+    }
+
+    reply.status = 0;
+    reply.length = st.st_size;
+    if (!write_all(fd, &reply, sizeof(reply)))
+    {
+	close(tmp);
+	return FALSE;
+    }
+    while (off < st.st_size)
+    {
+	n = sendfile(fd, tmp, &off, st.st_size - off);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+    }
+    close(tmp);
+    return off == st.st_size;
+}
+
+
+static int serve_stat(int fd, char *path, struct served_image *img)
+{
+    struct direntry *dirent;
+    struct dos_stat st;
+    int nextents;
+
+    memset(&st, 0, sizeof(st));
+    pthread_rwlock_rdlock(&img->lock);
+    dirent = find_path(path, img->vol);
+    if (dirent != NULL)
+    {
+	st.size = getulong(dirent->deFileSize);
+	st.start_cluster = getushort(dirent->deStartCluster);
+	st.attributes = dirent->deAttributes;
+	chain_bytes(dirent, img->vol, &st.nclusters, &nextents);
+	st.nextents = nextents;
+    }
+    pthread_rwlock_unlock(&img->lock);
+
+    if (dirent == NULL)
+	return send_reply(fd, -ENOENT, NULL, 0);
+    return send_reply(fd, 0, &st, sizeof(st));
+}
+
+
+/* serve_write takes the file's contents off the socket first, into an
+   anonymous file, so a slow client doesn't hold the image's write
+   lock while it trickles its data in */
+static int serve_write(int fd, char *image, char *path, uint32_t length)
+{
+    struct served_image *img;
+    uint8_t buf[65536];
+    uint32_t want;
+    int tmp, rv;
+
+    tmp = memfd_create("dos_server", 0);
+    if (tmp < 0)
+	return FALSE;
+    while (length > 0)
+    {
+	want = length < sizeof(buf) ? length : sizeof(buf);
+	if (!read_all(fd, buf, want) || !write_all(tmp, buf, want))
+	{
+	    close(tmp);
+	    return FALSE;
+	}
+	length -= want;
+    }
+    lseek(tmp, 0, SEEK_SET);
+
+    img = get_image(image);
+    if (img == NULL)
+	rv = -errno;
+    else
+    {
+	pthread_rwlock_wrlock(&img->lock);
+	rv = copyin_fd(tmp, path, img->vol);
+	flush_fat(img->vol);
+	pthread_rwlock_unlock(&img->lock);
+	put_image(img);
+    }
+
+    close(tmp);
+    return send_reply(fd, rv, NULL, 0);
+}
+
+
+/* serve_client handles one connection's requests until it closes */
+static void *serve_client(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    struct dos_request req;
+    struct served_image *img;
+    char image[DOSP_MAXNAME + 1], path[DOSP_MAXNAME + 1];
+    int ok;
+
+    while (read_all(fd, &req, sizeof(req)))
+    {
+	if (req.magic != DOSP_MAGIC ||
+	    req.image_len > DOSP_MAXNAME || req.path_len > DOSP_MAXNAME)
+	    break;
+	if (!read_all(fd, image, req.image_len) ||
+	    !read_all(fd, path, req.path_len))
+	    break;
+	image[req.image_len] = '\0';
+	path[req.path_len] = '\0';
+
+	if (req.op == DOSP_WRITE)
+	{
+	    if (!serve_write(fd, image, path, req.length))
+		break;
+	    continue;
+	}
+
+	img = get_image(image);
+	if (img == NULL)
+	    ok = send_reply(fd, -errno, NULL, 0);
+	else
+	{
+	    switch (req.op)
+	    {
+	    case DOSP_LIST:
+		ok = serve_list(fd, path, img);
+		break;
+	    case DOSP_READ:
+		ok = serve_read(fd, path, req.offset, req.length, img);
+		break;
+	    case DOSP_STAT:
+		ok = serve_stat(fd, path, img);
+		break;
+	    default:
+		ok = send_reply(fd, -EINVAL, NULL, 0);
+	    }
+	    put_image(img);
+	}
+
+	if (!ok)
+	    break;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+
+static void stop(int sig)
+{
+    stopping = 1;
+}
+
+
+void usage(char *progname)
+{
+    fprintf(stderr, "usage: %s [-n <maximages>] <socketpath>\n", progname);
+    fprintf(stderr, "\tserves requests for disk images over a Unix domain socket\n");
+    exit(1);
+}
+
+
+int main(int argc, char** argv)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    pthread_attr_t attr;
+    pthread_t thread;
+    char *sockpath;
+    int listener, fd, i;
+
+    if (argc == 4 && strcmp(argv[1], "-n") == 0)
+    {
+	max_images = atoi(argv[2]);
+	sockpath = argv[3];
+    }
+    else if (argc == 2)
+	sockpath = argv[1];
+    else
+	usage(argv[0]);
+    if (max_images < 1 || strlen(sockpath) >= sizeof(addr.sun_path))
+	usage(argv[0]);
+
+    images = calloc(max_images, sizeof(struct served_image));
+    for (i = 0; i < max_images; i++)
+	pthread_rwlock_init(&images[i].lock, NULL);
+
+    /* pick the FAT kernels now, rather than racing to in the threads */
+    fat12_kernel_name();
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+    {
+	fprintf(stderr, "socket: %s\n", strerror(errno));
+	exit(1);
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, sockpath);
+    unlink(sockpath);
+    if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	listen(listener, 64) < 0)
+    {
+	fprintf(stderr, "Can't listen on %s: %s\n", sockpath, strerror(errno));
+	exit(1);
+    }
+
+    /* clients that go away mid-reply shouldn't take the server with
+       them; SIGINT and SIGTERM interrupt accept, and shut down */
+    signal(SIGPIPE, SIG_IGN);
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    while (!stopping)
+    {
+	fd = accept(listener, NULL, NULL);
+	if (fd < 0)
+	    continue;
+	if (pthread_create(&thread, &attr, serve_client,
+			   (void *)(intptr_t)fd) != 0)
+	    close(fd);
+    }
+
+    close(listener);
+    unlink(sockpath);
+
+    /* wait for any request in progress, and write everything back.
+       The locks stay held, so nothing else starts on the images, and
+       get_image opens nothing new once stopping is set - but an image
+       it's already opening has to be finished before it can be
+       closed. */
+    for (i = 0; i < max_images; i++)
+    {
+	pthread_rwlock_wrlock(&images[i].lock);
+	pthread_mutex_lock(&images_lock);
+	while (images[i].loading)
+	    pthread_cond_wait(&images_loaded, &images_lock);
+	if (images[i].vol != NULL)
+	{
+	    sync_volume(images[i].vol);
+	    close_volume(images[i].vol);
+	    images[i].vol = NULL;
+	}
+	pthread_mutex_unlock(&images_lock);
+    }
+    return 0;
+}
@@ -0,0 +1,996 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <string.h>
+#include <assert.h>
+#include <ctype.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* The operations behind dos_ls, dos_cat and dos_cp, shared so that
+   they can also be run many times against one open volume (see
+   dos_batch). They report problems on stderr and return a failure
+   indication, rather than exiting, and leave that to the caller. */
+
+
+/* ---- listing (dos_ls) ---- */
+
+void ls_indent(FILE *out, int indent)
+{
+    int i;
+    for (i = 0; i < indent*4; i++)
+	fputc(' ', out);
+}
+
+
+/* ls_dirent prints one directory entry in dos_ls's format, and
+   returns the cluster of the directory it names, if it does */
+uint16_t ls_dirent(FILE *out, struct direntry *dirent, int indent)
+{
+    uint16_t followclust = 0;
+
+    int i;
+    char name[9];
+    char extension[4];
+    uint32_t size;
+    uint16_t file_cluster;
+    name[8] = ' ';
+    extension[3] = ' ';
+    memcpy(name, &(dirent->deName[0]), 8);
+    memcpy(extension, dirent->deExtension, 3);
+    if (name[0] == SLOT_EMPTY)
+    {
+	return followclust;
+    }
+
+    /* skip over deleted entries */
+    if (((uint8_t)name[0]) == SLOT_DELETED)
+    {
+	return followclust;
+    }
+
+    if (((uint8_t)name[0]) == 0x2E)
+    {
+	// dot entry ("." or "..")
+	// skip it
+        return followclust;
+    }
+
+    /* names are space padded - remove the spaces */
+    for (i = 8; i > 0; i--) 
+    {
+	if (name[i] == ' ') 
+	    name[i] = '\0';
+	else 
+	    break;
+    }
+
+    /* remove the spaces from extensions */
+    for (i = 3; i > 0; i--) 
+    {
+	if (extension[i] == ' ') 
+	    extension[i] = '\0';
+	else 
+	    break;
+    }
+
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+    {
+	// ignore any long file name extension entries
+	//
+	// printf("Win95 long-filename entry seq 0x%0x\n", dirent->deName[0]);
+    }
+    else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
+    {
+	fprintf(out, "Volume: %s\n", name);
+    } 
+    else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
+    {
+        // don't deal with hidden directories; MacOS makes these
+        // for trash directories and such; just ignore them.
+	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
+        {
+	    ls_indent(out, indent);
+    	    fprintf(out, "%s/ (directory)\n", name);
+            file_cluster = getushort(dirent->deStartCluster);
+            followclust = file_cluster;
+        }
+    }
+    else 
+    {
+        /*
+         * a "regular" file entry
+         * print attributes, size, starting cluster, etc.
+         */
+	int ro = (dirent->deAttributes & ATTR_READONLY) == ATTR_READONLY;
+	int hidden = (dirent->deAttributes & ATTR_HIDDEN) == ATTR_HIDDEN;
+	int sys = (dirent->deAttributes & ATTR_SYSTEM) == ATTR_SYSTEM;
+	int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
+
+	size = getulong(dirent->deFileSize);
+	ls_indent(out, indent);
+	fprintf(out, "%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
+	       name, extension, size, getushort(dirent->deStartCluster),
+	       ro?'r':' ', 
+               hidden?'h':' ', 
+               sys?'s':' ', 
+               arch?'a':' ');
+    }
+
+    return followclust;
+}
+
+
+static uint16_t ls_visit(struct direntry *dirent, int indent, void *out)
+{
+    return ls_dirent(out, dirent, indent);
+}
+
+
+/* ls_dir prints the directory starting at cluster, and everything
+   under it */
+void ls_dir(FILE *out, uint16_t cluster, int indent,
+	    struct fat_volume *vol)
+{
+    walk_dirs(cluster, indent, ls_visit, out, vol);
+}
+
+
+/* list_volume prints the whole directory tree, as dos_ls does */
+void list_volume(FILE *out, struct fat_volume *vol)
+{
+    walk_dirs(MSDOSFSROOT, 0, ls_visit, out, vol);
+}
+
+
+
+/* list_path lists just the directory at path (or everything, if path
+   is empty or "/").  Returns 0, or -1 if path isn't a directory. */
+int list_path(FILE *out, char *path, struct fat_volume *vol)
+{
+    struct direntry *dirent;
+
+    if (path[strspn(path, "/\\")] == '\0')
+    {
+	list_volume(out, vol);
+	return 0;
+    }
+    dirent = find_path(path, vol);
+    if (dirent == NULL || (dirent->deAttributes & ATTR_DIRECTORY) == 0)
+    {
+	fprintf(stderr, "No directory called %s exists in the disk image\n",
+		path);
+	return -1;
+    }
+    ls_dir(out, getushort(dirent->deStartCluster), 0, vol);
+    return 0;
+}
+
+
+/* ---- path lookup and cat (dos_cat) ---- */
+
+/* get_dirent puts the name of a live file or directory entry in
+   buffer (or an empty string), and returns the cluster of the
+   directory it names, if it does */
+uint16_t get_dirent(struct direntry *dirent, char *buffer)
+{
+    uint16_t followclust = 0;
+    memset(buffer, 0, MAXFILENAME);
+
+    int i;
+    char name[9];
+    char extension[4];
+    uint16_t file_cluster;
+    name[8] = ' ';
+    extension[3] = ' ';
+    memcpy(name, &(dirent->deName[0]), 8);
+    memcpy(extension, dirent->deExtension, 3);
+    if (name[0] == SLOT_EMPTY)
+    {
+	return followclust;
+    }
+
+    /* skip over deleted entries */
+    if (((uint8_t)name[0]) == SLOT_DELETED)
+    {
+	return followclust;
+    }
+
+    if (((uint8_t)name[0]) == 0x2E)
+    {
+	// dot entry ("." or "..")
+	// skip it
+        return followclust;
+    }
+
+    /* names are space padded - remove the spaces */
+    for (i = 8; i > 0; i--) 
+    {
+	if (name[i] == ' ') 
+	    name[i] = '\0';
+	else 
+	    break;
+    }
+
+    /* remove the spaces from extensions */
+    for (i = 3; i > 0; i--) 
+    {
+	if (extension[i] == ' ') 
+	    extension[i] = '\0';
+	else 
+	    break;
+    }
+
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN)
+    {
+	// ignore any long file name extension entries
+	//
+	// printf("Win95 long-filename entry seq 0x%0x\n", dirent->deName[0]);
+    }
+    else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
+    {
+        // don't deal with hidden directories; MacOS makes these
+        // for trash directories and such; just ignore them.
+	if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
+        {
+            strcpy(buffer, name);
+            file_cluster = getushort(dirent->deStartCluster);
+            followclust = file_cluster;
+        }
+    }
+    else 
+    {
+        /*
+         * a "regular" file entry
+         * print attributes, size, starting cluster, etc.
+         */
+        strcpy(buffer, name);
+        if (strlen(extension))  
+        {
+            strcat(buffer, ".");
+            strcat(buffer, extension);
+        }
+    }
+
+    return followclust;
+}
+
+
+/* find_path finds the dirent for a path such as "/dir/file.txt" */
+struct direntry *find_path(char *searchpath, struct fat_volume *vol)
+{
+    return lookup_path(searchpath, MSDOSFSROOT, NULL, vol);
+}
+
+
+/* write_out sends len bytes from byte offset off of the disk image to
+   outfd.  If outfd is a pipe, splice moves the pages from the image
+   file straight into it; if it's a socket, sendfile does the same.
+   Anything else (or a kernel that refuses) gets plain writes straight
+   from the mapping, a whole extent at a time rather than through
+   stdio.  Returns TRUE on success. */
+static int write_out(int outfd, int out_mode, struct fat_volume *vol,
+		     off_t off, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+	if (out_mode == S_IFIFO)
+	    n = splice(vol->fd, &off, outfd, NULL, len, SPLICE_F_MORE);
+	else if (out_mode == S_IFSOCK)
+	    n = sendfile(outfd, vol->fd, &off, len);
+	else
+	{
+	    n = write(outfd, vol->image_buf + off, len);
+	    if (n > 0)
+		off += n;
+	}
+
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && out_mode != 0 && (errno == EINVAL || errno == ENOSYS))
+	{
+	    /* no zero-copy path here after all */
+	    out_mode = 0;
+	    continue;
+	}
+	if (n <= 0)
+	    return FALSE;
+	len -= n;
+	STAT_ADD(bytes_copied, n);
+    }
+    return TRUE;
+}
+
+
+/* cat_file writes the whole file to outfd, a contiguous extent at a
+   time.  Returns 0 on success, -1 if a write failed. */
+int cat_file(struct direntry *dirent, int outfd, struct fat_volume *vol)
+{
+    uint16_t cluster = getushort(dirent->deStartCluster);
+    uint32_t bytes_remaining = getulong(dirent->deFileSize);
+    uint32_t cluster_size = vol->bytes_per_cluster;
+    struct extent *ext;
+    struct stat st;
+    int nextents, e, out_mode = 0, rv = 0;
+
+    if (fstat(outfd, &st) == 0 && 
+	(S_ISFIFO(st.st_mode) || S_ISSOCK(st.st_mode)))
+	out_mode = st.st_mode & S_IFMT;
+
+    nextents = chain_extents(cluster, &ext, vol);
+    for (e = 0; e < nextents && bytes_remaining > 0; e++)
+    {
+        uint32_t nbytes = ext[e].count * cluster_size;
+        if (nbytes > bytes_remaining)
+            nbytes = bytes_remaining;
+
+        /* map the cluster number to the data location */
+        uint8_t *p = cluster_to_addr(ext[e].start, vol);
+        STAT_ADD(clusters, ext[e].count - 1);
+
+        if (!write_out(outfd, out_mode, vol, p - vol->image_buf, nbytes))
+        {
+            fprintf(stderr, "write failed: %s\n", strerror(errno));
+            rv = -1;
+            break;
+        }
+        bytes_remaining -= nbytes;
+    }
+    free(ext);
+    return rv;
+}
+
+
+/* cat_range writes length bytes of the file, starting at byte offset,
+   to outfd.  The file's seek index means the clusters before offset
+   are never touched.  Returns 0 on success, -1 if a write failed. */
+int cat_range(struct direntry *dirent, uint32_t offset, uint32_t length,
+	      int outfd, struct fat_volume *vol)
+{
+    struct fat_file *file = fat_open(dirent, vol);
+    uint8_t buf[65536];
+    ssize_t n, done, w;
+    size_t want;
+    int rv = 0;
+
+    while (length > 0 && rv == 0)
+    {
+        want = length < sizeof(buf) ? length : sizeof(buf);
+        n = fat_pread(file, buf, want, offset);
+        if (n <= 0)
+            break;
+        for (done = 0; done < n; done += w)
+        {
+            w = write(outfd, buf + done, n - done);
+            if (w < 0 && errno == EINTR)
+            {
+                w = 0;
+                continue;
+            }
+            if (w <= 0)
+            {
+                fprintf(stderr, "write failed: %s\n", strerror(errno));
+                rv = -1;
+                break;
+            }
+        }
+        offset += n;
+        length -= n;
+    }
+    fat_close(file);
+    return rv;
+}
+
+
+
+/* ---- copying (dos_cp) ---- */
+
+/* get_name retrieves the filename from a directory entry */
+
+void get_name(char *fullname, struct direntry *dirent) 
+{
+    char name[9];
+    char extension[4];
+    int i;
+
+    name[8] = ' ';
+    extension[3] = ' ';
+    memcpy(name, &(dirent->deName[0]), 8);
+    memcpy(extension, dirent->deExtension, 3);
+
+    /* names are space padded - remove the padding */
+    for (i = 8; i > 0; i--) 
+    {
+	if (name[i] == ' ') 
+	    name[i] = '\0';
+	else 
+	    break;
+    }
+
+    /* extensions aren't normally space padded - but remove the
+       padding anyway if it's there */
+    for (i = 3; i > 0; i--) 
+    {
+	if (extension[i] == ' ') 
+	    extension[i] = '\0';
+	else 
+	    break;
+    }
+    fullname[0]='\0';
+    strcat(fullname, name);
+
+    /* append the extension if it's not a directory */
+    if ((dirent->deAttributes & ATTR_DIRECTORY) == 0) 
+    {
+	strcat(fullname, ".");
+	strcat(fullname, extension);
+    }
+}
+
+
+/* find_file finds the named file, starting from the directory at
+   cluster.  With FIND_DIR, it returns the first dirent of the
+   directory the file would be in instead.  The dirent found may be a
+   directory or a volume label; it's up to the caller to check. */
+
+struct direntry* find_file(char *infilename, uint16_t cluster,
+			   int find_mode,
+			   struct fat_volume *vol)
+{
+    struct direntry *dirent;
+    int32_t parent;
+
+    dirent = lookup_path(infilename, cluster, &parent, vol);
+    if (find_mode == FIND_FILE)
+	return dirent;
+    if (parent < 0)
+	return NULL;
+    return (struct direntry*)cluster_to_addr(parent, vol);
+}
+
+
+/* write_extent moves len bytes starting at byte offset off in the
+   disk image to offset out_off in the output file.  It lets the
+   kernel do the copy with copy_file_range where it can, and falls
+   back to pwrite (or plain write, for pipes) from the memory mapping
+   where it can't: older kernels, different filesystems, output that
+   isn't a regular file.
+   Returns TRUE on success. */
+static int write_extent(int fd, struct fat_volume *vol,
+			off_t off, off_t out_off, size_t len)
+{
+    ssize_t n;
+    int use_cfr = TRUE;
+
+    while (len > 0) 
+    {
+	if (use_cfr) 
+	{
+	    n = copy_file_range(vol->fd, &off, fd, &out_off, len, 0);
+	    if (n > 0) 
+	    {
+		len -= n;
+		STAT_ADD(bytes_copied, n);
+		continue;
+	    }
+	    if (n < 0 && errno == EINTR)
+		continue;
+	    /* no luck (or a short image) - do it ourselves */
+	    use_cfr = FALSE;
+	}
+	n = pwrite(fd, vol->image_buf + off, len, out_off);
+	if (n < 0 && errno == ESPIPE)
+	    n = write(fd, vol->image_buf + off, len);   /* a pipe or terminal */
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return FALSE;
+	off += n;
+	out_off += n;
+	len -= n;
+	STAT_ADD(bytes_copied, n);
+    }
+    return TRUE;
+}
+
+/* copy_out_file actually does the work of copying.  It collapses the
+   file's cluster chain into physically contiguous extents, and moves
+   each extent to the output file in one go.  Returns 0, or -1 if
+   writing the output failed. */
+
+int copy_out_file(int fd, uint16_t cluster, 
+		  uint32_t bytes_remaining,
+		  struct fat_volume *vol)
+{
+    struct extent *ext;
+    int nextents, e, err, preallocated = FALSE, rv = 0;
+    uint32_t clust_size, len;
+    off_t out_off = 0;
+
+    clust_size = vol->bytes_per_cluster;
+
+    if (cluster == 0) 
+    {
+	fprintf(stderr, "Bad file termination\n");
+	return 0;
+    }
+
+    /* tell the filesystem how much is coming, so it can lay the
+       output out in one piece.  Not every filesystem can, and pipes
+       and devices can't at all, but running out of space is an
+       error. */
+    if (bytes_remaining > 0)
+    {
+	err = posix_fallocate(fd, 0, bytes_remaining);
+	if (err == 0)
+	    preallocated = TRUE;
+	else if (err != EOPNOTSUPP && err != EINVAL && err != ESPIPE &&
+		 err != ENODEV)
+	{
+	    fprintf(stderr, "Can't make room for the file: %s\n",
+		    strerror(err));
+	    return -1;
+	}
+    }
+
+    nextents = chain_extents(cluster, &ext, vol);
+    for (e = 0; e < nextents && bytes_remaining > 0; e++) 
+    {
+	len = ext[e].count * clust_size;
+	if (len > bytes_remaining)
+	    len = bytes_remaining;
+	STAT_ADD(clusters, ext[e].count - 1);
+
+	if (!write_extent(fd, vol, 
+			  cluster_to_addr(ext[e].start, vol) - vol->image_buf,
+			  out_off, len)) 
+	{
+	    fprintf(stderr, "Write failed: %s\n", strerror(errno));
+	    rv = -1;
+	    break;
+	}
+	out_off += len;
+	bytes_remaining -= len;
+    }
+    free(ext);
+
+    /* if the chain was shorter than the file claimed to be (or a
+       write failed), don't leave the preallocated tail behind */
+    if (preallocated && ftruncate(fd, out_off) < 0)
+    {
+	fprintf(stderr, "Can't truncate the file: %s\n", strerror(errno));
+	rv = -1;
+    }
+    return rv;
+}
+
+/* copyout copies a file from the FAT-12 memory disk image to a
+   regular file in the file system.  The "a:" volume prefix on
+   infilename is optional.  Returns 0 on success, -1 on failure. */
+
+int copyout(char *infilename, char* outfilename,
+	    struct fat_volume *vol)
+{
+    struct direntry *dirent = (void*)1;
+    int fd;
+    uint16_t start_cluster;
+    uint32_t size;
+
+    /* skip the volume name */
+    if (strncmp("a:", infilename, 2)==0)
+	infilename+=2;
+
+    /* find the dirent of the file in the memory disk image */
+    dirent = find_file(infilename, 0, FIND_FILE, vol);
+    if (dirent == NULL) 
+    {
+	fprintf(stderr, "No file called %s exists in the disk image\n",
+		infilename);
+	return -1;
+    }
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
+    {
+	fprintf(stderr, "Cannot copy out a directory\n");
+	return -1;
+    }
+    if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
+    {
+	fprintf(stderr, "Cannot copy out a volume\n");
+	return -1;
+    }
+
+    /* open the real file for writing */
+    fd = open(outfilename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) 
+    {
+	fprintf(stderr, "Can't open file %s to copy data out\n",
+		outfilename);
+	return -1;
+    }
+
+    /* do the actual copy out*/
+    start_cluster = getushort(dirent->deStartCluster);
+    size = getulong(dirent->deFileSize);
+    if (copy_out_file(fd, start_cluster, size, vol) < 0)
+    {
+	close(fd);
+	return -1;
+    }
+    if (close(fd) < 0)
+    {
+	fprintf(stderr, "Can't write %s: %s\n", outfilename, strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+/* read_fully reads up to len bytes into buf, carrying on after short
+   reads, and returns how many bytes it got before end of file, or -1
+   if a read failed */
+static ssize_t read_fully(int fd, uint8_t *buf, size_t len)
+{
+    size_t got = 0;
+    ssize_t n;
+
+    while (got < len) 
+    {
+	n = read(fd, buf + got, len - got);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    return -1;
+	if (n == 0)
+	    break;
+	got += n;
+    }
+    STAT_ADD(bytes_copied, got);
+    return got;
+}
+
+/* read_failed gives back everything copy_in_chain allocated when
+   reading the file in fails part way, as a half-copied file is no
+   use to anyone */
+static int read_failed(uint16_t start_cluster, uint32_t *size,
+		       struct fat_volume *vol)
+{
+    fprintf(stderr, "Read failed: %s\n", strerror(errno));
+    if (start_cluster != 0)
+	free_chain(start_cluster, vol);
+    *size = 0;
+    return -EIO;
+}
+
+/* copy_in_file (copy_in_chain, with the hardware counters round it)
+   actually does the copying of the file into the memory image,
+   updates the FAT, and sets *start to the starting cluster of the
+   file.  The data is read straight from fd into the clusters of the
+   mapped image: one read per extent when the size is known up front,
+   otherwise one per cluster.  Only the slack after the end of the
+   file in its last cluster is zeroed.  Returns 0, or -ENOSPC if the
+   disk filled up or -EIO if reading fd failed, in which case nothing
+   is left allocated. */
+
+static int copy_in_chain(int fd, struct fat_volume *vol, 
+			 uint16_t *start, uint32_t *size)
+{
+    uint32_t clust_size, used;
+    struct stat st;
+    struct extent *ext;
+    int nextents, e;
+    size_t want;
+    ssize_t got;
+    uint8_t *p, c;
+    uint16_t start_cluster = 0;
+    uint16_t last_cluster = 0;
+    uint16_t cluster, next;
+    
+    clust_size = vol->bytes_per_cluster;
+
+    /* if we know how big the file is, reserve all of its clusters up
+       front, so they can be laid out contiguously */
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) 
+    {
+	start_cluster = alloc_chain((st.st_size + clust_size - 1) / clust_size, vol);
+	if (start_cluster == 0) 
+	{
+	    fprintf(stderr, "No more space in filesystem\n");
+	    return -ENOSPC;
+	}
+    }
+
+    if (start_cluster != 0) 
+    {
+	/* fill the reserved clusters, an extent at a time */
+	nextents = chain_extents(start_cluster, &ext, vol);
+	got = want = 0;
+	for (e = 0; e < nextents; e++) 
+	{
+	    p = cluster_to_addr(ext[e].start, vol);
+	    STAT_ADD(clusters, ext[e].count - 1);
+	    want = ext[e].count * clust_size;
+	    got = read_fully(fd, p, want);
+	    if (got < 0)
+	    {
+		free(ext);
+		return read_failed(start_cluster, size, vol);
+	    }
+	    *size += got;
+	    if ((size_t)got < want)
+		break;
+	    last_cluster = ext[e].start + ext[e].count - 1;
+	}
+
+	if (e < nextents) 
+	{
+	    /* the file ended early: zero the slack, and give back
+	       whatever we reserved but didn't need */
+	    used = (got + clust_size - 1) / clust_size;
+	    memset(p + got, 0, used * clust_size - got);
+	    if (used > 0)
+		last_cluster = ext[e].start + used - 1;
+
+	    if (last_cluster == 0) 
+	    {
+		free_chain(start_cluster, vol);
+		start_cluster = 0;
+	    } 
+	    else 
+	    {
+		next = get_fat_entry(last_cluster, vol);
+		if (is_valid_cluster(next, vol)) 
+		{
+		    set_fat_entry(last_cluster, FAT12_MASK&CLUST_EOFS, vol);
+		    free_chain(next, vol);
+		}
+	    }
+	    free(ext);
+	    *start = start_cluster;
+	    return 0;
+	}
+	free(ext);
+    }
+
+    /* the size wasn't known (or the file grew since we looked), so
+       carry on a cluster at a time, reading straight into the next
+       free cluster before claiming it */
+    while(1) 
+    {
+	cluster = find_free_cluster(vol);
+	if (cluster == 0) 
+	{
+	    /* out of space - which only matters if there's more to come */
+	    if (read(fd, &c, 1) > 0) 
+	    {
+		fprintf(stderr, "No more space in filesystem\n");
+		if (start_cluster != 0)
+		    free_chain(start_cluster, vol);
+		*size = 0;
+		return -ENOSPC;
+	    }
+	    break;
+	}
+
+	p = cluster_to_addr(cluster, vol);
+	got = read_fully(fd, p, clust_size);
+	if (got < 0)
+	    return read_failed(start_cluster, size, vol);
+	if (got == 0)
+	    break;
+	*size += got;
+	memset(p + got, 0, clust_size - got);
+
+	/* remember the first cluster, as we need to store this in the
+	   dirent */
+	if (start_cluster == 0) 
+	{
+	    start_cluster = cluster;
+	} 
+	else 
+	{
+	    /* link the previous cluster to this one in the FAT */
+	    assert(last_cluster != 0);
+	    set_fat_entry(last_cluster, cluster, vol);
+	}
+
+	/* make sure we've recorded this cluster as used */
+	set_fat_entry(cluster, FAT12_MASK&CLUST_EOFS, vol);
+	last_cluster = cluster;
+
+	if ((size_t)got < clust_size) 
+	{
+	    /* We didn't read a full cluster, so we reached end of
+	       file */
+	    break;
+	}
+    }
+
+    *start = start_cluster;
+    return 0;
+}
+
+int copy_in_file(int fd, struct fat_volume *vol, 
+		 uint16_t *start, uint32_t *size)
+{
+    struct perf_mark pm;
+    int rv;
+
+    perf_begin(&pm);
+    rv = copy_in_chain(fd, vol, start, size);
+    perf_end(PERF_COPY_IN, &pm, *size);
+    return rv;
+}
+
+/* write the values into a directory entry */
+void write_dirent(struct direntry *dirent, char *filename, 
+		  uint16_t start_cluster, uint32_t size)
+{
+    char *p, *p2;
+    char *uppername;
+    int len, i;
+
+    /* clean out anything old that used to be here */
+    memset(dirent, 0, sizeof(struct direntry));
+
+    /* extract just the filename part */
+    uppername = strdup(filename);
+    p2 = uppername;
+    for (i = 0; i < strlen(filename); i++) 
+    {
+	if (p2[i] == '/' || p2[i] == '\\') 
+	{
+	    uppername = p2+i+1;
+	}
+    }
+
+    /* convert filename to upper case */
+    for (i = 0; i < strlen(uppername); i++) 
+    {
+	uppername[i] = toupper(uppername[i]);
+    }
+
+    /* set the file name and extension */
+    memset(dirent->deName, ' ', 8);
+    p = strchr(uppername, '.');
+    memcpy(dirent->deExtension, "___", 3);
+    if (p == NULL) 
+    {
+	fprintf(stderr, "No filename extension given - defaulting to .___\n");
+    }
+    else 
+    {
+	*p = '\0';
+	p++;
+	len = strlen(p);
+	if (len > 3) len = 3;
+	memcpy(dirent->deExtension, p, len);
+    }
+
+    if (strlen(uppername)>8) 
+    {
+	uppername[8]='\0';
+    }
+    memcpy(dirent->deName, uppername, strlen(uppername));
+    free(p2);
+
+    /* set the attributes and file size */
+    dirent->deAttributes = ATTR_NORMAL;
+    putushort(dirent->deStartCluster, start_cluster);
+    putulong(dirent->deFileSize, size);
+
+    /* could also set time and date here if we really
+       cared... */
+}
+
+
+/* create_dirent finds a free slot in the directory, and write the
+   directory entry */
+
+void create_dirent(struct direntry *dirent, char *filename, 
+		   uint16_t start_cluster, uint32_t size,
+		   struct fat_volume *vol)
+{
+    while (1) 
+    {
+	if (dirent->deName[0] == SLOT_EMPTY) 
+	{
+	    /* we found an empty slot at the end of the directory */
+	    write_dirent(dirent, filename, start_cluster, size);
+	    dir_written(dirent, vol);
+	    dirent++;
+
+	    /* make sure the next dirent is set to be empty, just in
+	       case it wasn't before */
+	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
+	    dirent->deName[0] = SLOT_EMPTY;
+	    return;
+	}
+
+	if (dirent->deName[0] == SLOT_DELETED) 
+	{
+	    /* we found a deleted entry - we can just overwrite it */
+	    write_dirent(dirent, filename, start_cluster, size);
+	    dir_written(dirent, vol);
+	    return;
+	}
+	dirent++;
+    }
+}
+
+/* copyin_fd copies everything that can be read from fd into a new
+   file in the FAT-12 memory disk image.  The "a:" volume prefix on
+   outfilename is optional.  Returns 0 on success, or -EEXIST, -ENOENT
+   (no such directory), -ENOSPC or -EIO (reading fd failed). */
+
+int copyin_fd(int fd, char* outfilename, struct fat_volume *vol)
+{
+    struct direntry *dirent = (void*)1;
+    uint16_t start_cluster = 0;
+    uint32_t size = 0;
+    int rv;
+
+    if (strncmp("a:", outfilename, 2)==0)
+	outfilename+=2;
+
+    /* check that the file doesn't already exist */
+    dirent = find_file(outfilename, 0, FIND_FILE, vol);
+    if (dirent != NULL) 
+    {
+	fprintf(stderr, "File %s already exists\n", outfilename);
+	return -EEXIST;
+    }
+
+    /* find the dirent of the directory to put the file in */
+    dirent = find_file(outfilename, 0, FIND_DIR, vol);
+    if (dirent == NULL) 
+    {
+	fprintf(stderr, "Directory does not exists in the disk image\n");
+	return -ENOENT;
+    }
+
+    /* do the actual copy in*/
+    rv = copy_in_file(fd, vol, &start_cluster, &size);
+    if (rv < 0)
+	return rv;
+
+    /* create the directory entry */
+    create_dirent(dirent, outfilename, start_cluster, size, vol);
+    return 0;
+}
+
+/* copyin copies a file from a regular file on the filesystem into a
+   file in the FAT-12 memory disk image.  Returns 0 on success, or a
+   negative errno value on failure. */
+
+int copyin(char *infilename, char* outfilename,
+	   struct fat_volume *vol)
+{
+    int fd, rv;
+
+    /* open the real file for reading */
+    fd = open(infilename, O_RDONLY);
+    if (fd < 0) 
+    {
+	rv = -errno;
+	fprintf(stderr, "Can't open file %s to copy data in\n",
+		infilename);
+	return rv;
+    }
+
+    rv = copyin_fd(fd, outfilename, vol);
+    close(fd);
+    return rv;
+}
@@ -0,0 +1,57 @@
+#ifndef __DOSPROTO_H__
+#define __DOSPROTO_H__
+
+/* The wire protocol between dos_server and its clients, over a Unix
+   domain stream socket.  A connection carries any number of requests,
+   one at a time.  Each request is a dos_request header, then the
+   image file name (image_len bytes), then the path within the image
+   (path_len bytes; for DOSP_LIST, the directory to list, or none for
+   everything), then for DOSP_WRITE the file's contents (length
+   bytes).  Names aren't NUL terminated.
+
+   Each reply is a dos_reply header, then length bytes of data:
+       DOSP_LIST   the listing, in dos_ls's format
+       DOSP_READ   the bytes of the file from offset on
+       DOSP_STAT   a struct dos_stat
+       DOSP_WRITE  nothing
+   status is 0, or a negative errno value, in which case there is no
+   data.  All fields are in host byte order - both ends are on the
+   same machine. */
+
+#include <stdint.h>
+
+#define DOSP_MAGIC 0x31544146   /* "FAT1" */
+
+#define DOSP_LIST  1
+#define DOSP_READ  2
+#define DOSP_STAT  3
+#define DOSP_WRITE 4
+
+#define DOSP_MAXNAME 1024
+
+struct dos_request {
+    uint32_t magic;
+    uint16_t op;
+    uint16_t image_len;
+    uint16_t path_len;
+    uint16_t pad;
+    uint32_t offset;            /* DOSP_READ: where to start */
+    uint32_t length;            /* DOSP_READ: most bytes wanted;
+				   DOSP_WRITE: bytes that follow */
+};
+
+struct dos_reply {
+    int32_t status;
+    uint32_t length;
+};
+
+struct dos_stat {
+    uint32_t size;
+    uint16_t start_cluster;
+    uint8_t attributes;
+    uint8_t pad;
+    uint32_t nclusters;
+    uint32_t nextents;
+};
+
+#endif // __DOSPROTO_H__
@@ -0,0 +1,308 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* Bulk conversion between the packed 12-bit FAT on disk and a flat
+   array of uint16_t entries.  Every three bytes on disk hold a pair
+   of entries:
+
+       byte 0     byte 1     byte 2
+       76543210   7654 3210  76543210
+       even[7:0]  odd[3:0]   odd[11:4]
+                  even[11:8]
+
+   The scalar versions handle any range.  The vector versions do the
+   even-aligned middle of a range, 8 (SSSE3) or 16 (AVX2) entries at
+   a time, and leave the ragged ends to the scalar code.  The best
+   kernel the CPU supports is picked the first time one is used. */
+
+
+static uint16_t unpack_one(const uint8_t *fat, uint32_t n)
+{
+    const uint8_t *p = fat + 3 * (n / 2);
+    if (n % 2 == 0)
+	return ((0x0f & p[1]) << 8) | p[0];
+    return (p[2] << 4) | ((0xf0 & p[1]) >> 4);
+}
+
+static void pack_one(uint8_t *fat, uint32_t n, uint16_t value)
+{
+    uint8_t *p = fat + 3 * (n / 2);
+    if (n % 2 == 0)
+    {
+	p[0] = (uint8_t)(0xff & value);
+	p[1] = (uint8_t)((0xf0 & p[1]) | (0x0f & (value >> 8)));
+    }
+    else
+    {
+	p[1] = (uint8_t)((0x0f & p[1]) | ((0x0f & value) << 4));
+	p[2] = (uint8_t)(0xff & (value >> 4));
+    }
+}
+
+/* scalar kernels: [first, first+count) with first and count even */
+static void unpack_pairs_scalar(const uint8_t *fat, uint16_t *table,
+				uint32_t first, uint32_t count)
+{
+    const uint8_t *p = fat + 3 * (first / 2);
+    uint16_t *t = table + first;
+    uint32_t i;
+
+    for (i = 0; i < count; i += 2, p += 3, t += 2)
+    {
+	t[0] = ((0x0f & p[1]) << 8) | p[0];
+	t[1] = (p[2] << 4) | ((0xf0 & p[1]) >> 4);
+    }
+}
+
+static void pack_pairs_scalar(uint8_t *fat, const uint16_t *table,
+			      uint32_t first, uint32_t count)
+{
+    uint8_t *p = fat + 3 * (first / 2);
+    const uint16_t *t = table + first;
+    uint32_t i;
+
+    for (i = 0; i < count; i += 2, p += 3, t += 2)
+    {
+	p[0] = (uint8_t)(0xff & t[0]);
+	p[1] = (uint8_t)((0x0f & (t[0] >> 8)) | ((0x0f & t[1]) << 4));
+	p[2] = (uint8_t)(0xff & (t[1] >> 4));
+    }
+}
+
+
+#ifdef HAVE_X86_KERNELS
+
+/* Unpacking: shuffle each 3-byte group into two little-endian 16-bit
+   words, (b0,b1) and (b1,b2).  The even word then just needs the top
+   nibble masked off, and the odd word needs shifting right by 4. */
+#define UNPACK_SHUF 0,1, 1,2, 3,4, 4,5, 6,7, 7,8, 9,10, 10,11
+
+/* Packing: merge each pair into a 24-bit value in a 32-bit lane,
+   then squeeze out every fourth byte */
+#define PACK_SHUF 0,1,2, 4,5,6, 8,9,10, 12,13,14, -1,-1,-1,-1
+
+__attribute__((target("ssse3")))
+static void unpack_pairs_ssse3(const uint8_t *fat, uint16_t *table,
+			       uint32_t first, uint32_t count)
+{
+    const uint8_t *p = fat + 3 * (first / 2);
+    uint16_t *t = table + first;
+    const __m128i shuf = _mm_setr_epi8(UNPACK_SHUF);
+    const __m128i even = _mm_set1_epi32(0x0000ffff);
+    const __m128i low12 = _mm_set1_epi16(0x0fff);
+    uint32_t i = 0;
+
+    /* each step reads 16 bytes but only consumes 12, so stop while
+       there is still a full vector's worth of input left */
+    for ( ; i + 8 <= count && 3 * (i / 2) + 16 <= 3 * (count / 2); i += 8)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i *)(p + 3 * (i / 2)));
+	v = _mm_shuffle_epi8(v, shuf);
+	__m128i lo = _mm_and_si128(v, low12);
+	__m128i hi = _mm_srli_epi16(v, 4);
+	v = _mm_or_si128(_mm_and_si128(even, lo), _mm_andnot_si128(even, hi));
+	_mm_storeu_si128((__m128i *)(t + i), v);
+    }
+    unpack_pairs_scalar(fat, table, first + i, count - i);
+}
+
+__attribute__((target("ssse3")))
+static void pack_pairs_ssse3(uint8_t *fat, const uint16_t *table,
+			     uint32_t first, uint32_t count)
+{
+    uint8_t *p = fat + 3 * (first / 2);
+    const uint16_t *t = table + first;
+    const __m128i shuf = _mm_setr_epi8(PACK_SHUF);
+    const __m128i evenmask = _mm_set1_epi32(0x00000fff);
+    const __m128i oddmask = _mm_set1_epi32(0x00fff000);
+    uint32_t i = 0;
+    int32_t tail;
+
+    for ( ; i + 8 <= count; i += 8)
+    {
+	__m128i v = _mm_loadu_si128((const __m128i *)(t + i));
+	v = _mm_or_si128(_mm_and_si128(v, evenmask),
+			 _mm_and_si128(_mm_srli_epi32(v, 4), oddmask));
+	v = _mm_shuffle_epi8(v, shuf);
+
+	/* only 12 of the 16 bytes are ours to write */
+	_mm_storel_epi64((__m128i *)(p + 3 * (i / 2)), v);
+	tail = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+	memcpy(p + 3 * (i / 2) + 8, &tail, 4);
+    }
+    pack_pairs_scalar(fat, table, first + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void unpack_pairs_avx2(const uint8_t *fat, uint16_t *table,
+			      uint32_t first, uint32_t count)
+{
+    const uint8_t *p = fat + 3 * (first / 2);
+    uint16_t *t = table + first;
+    const __m256i shuf = _mm256_setr_epi8(UNPACK_SHUF, UNPACK_SHUF);
+    const __m256i even = _mm256_set1_epi32(0x0000ffff);
+    const __m256i low12 = _mm256_set1_epi16(0x0fff);
+    uint32_t i = 0;
+
+    /* the upper lane's 16-byte load starts 12 bytes in */
+    for ( ; i + 16 <= count && 3 * (i / 2) + 28 <= 3 * (count / 2); i += 16)
+    {
+	const uint8_t *q = p + 3 * (i / 2);
+	__m256i v = _mm256_inserti128_si256(
+	    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)q)),
+	    _mm_loadu_si128((const __m128i *)(q + 12)), 1);
+	v = _mm256_shuffle_epi8(v, shuf);
+	__m256i lo = _mm256_and_si256(v, low12);
+	__m256i hi = _mm256_srli_epi16(v, 4);
+	v = _mm256_blendv_epi8(hi, lo, even);
+	_mm256_storeu_si256((__m256i *)(t + i), v);
+    }
+    unpack_pairs_ssse3(fat, table, first + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void pack_pairs_avx2(uint8_t *fat, const uint16_t *table,
+			    uint32_t first, uint32_t count)
+{
+    uint8_t *p = fat + 3 * (first / 2);
+    const uint16_t *t = table + first;
+    const __m256i shuf = _mm256_setr_epi8(PACK_SHUF, PACK_SHUF);
+    const __m256i evenmask = _mm256_set1_epi32(0x00000fff);
+    const __m256i oddmask = _mm256_set1_epi32(0x00fff000);
+    uint32_t i = 0;
+    int32_t tail;
+
+    for ( ; i + 16 <= count; i += 16)
+    {
+	uint8_t *q = p + 3 * (i / 2);
+	__m256i v = _mm256_loadu_si256((const __m256i *)(t + i));
+	v = _mm256_or_si256(_mm256_and_si256(v, evenmask),
+			    _mm256_and_si256(_mm256_srli_epi32(v, 4), oddmask));
+	v = _mm256_shuffle_epi8(v, shuf);
+
+	/* each lane holds 12 packed bytes */
+	__m128i lo = _mm256_castsi256_si128(v);
+	__m128i hi = _mm256_extracti128_si256(v, 1);
+	_mm_storel_epi64((__m128i *)q, lo);
+	tail = _mm_cvtsi128_si32(_mm_srli_si128(lo, 8));
+	memcpy(q + 8, &tail, 4);
+	_mm_storel_epi64((__m128i *)(q + 12), hi);
+	tail = _mm_cvtsi128_si32(_mm_srli_si128(hi, 8));
+	memcpy(q + 20, &tail, 4);
+    }
+    pack_pairs_ssse3(fat, table, first + i, count - i);
+}
+
+#endif // HAVE_X86_KERNELS
+
+
+static void (*unpack_pairs)(const uint8_t *, uint16_t *, uint32_t, uint32_t);
+static void (*pack_pairs)(uint8_t *, const uint16_t *, uint32_t, uint32_t);
+
+/* pick the fastest kernels this CPU can run.  FAT12_KERNEL=scalar,
+   ssse3 or avx2 in the environment overrides the choice (mostly
+   useful for comparing them). */
+static void choose_kernels(void)
+{
+    const char *force = getenv("FAT12_KERNEL");
+
+    unpack_pairs = unpack_pairs_scalar;
+    pack_pairs = pack_pairs_scalar;
+    if (force != NULL && strcmp(force, "scalar") == 0)
+	return;
+
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") &&
+	(force == NULL || strcmp(force, "avx2") == 0))
+    {
+	unpack_pairs = unpack_pairs_avx2;
+	pack_pairs = pack_pairs_avx2;
+    }
+    else if (__builtin_cpu_supports("ssse3"))
+    {
+	unpack_pairs = unpack_pairs_ssse3;
+	pack_pairs = pack_pairs_ssse3;
+    }
+#endif
+}
+
+
+/* fat12_kernel_name says which kernels are in use */
+const char *fat12_kernel_name(void)
+{
+    if (unpack_pairs == NULL)
+	choose_kernels();
+#ifdef HAVE_X86_KERNELS
+    if (unpack_pairs == unpack_pairs_avx2)
+	return "avx2";
+    if (unpack_pairs == unpack_pairs_ssse3)
+	return "ssse3";
+#endif
+    return "scalar";
+}
+
+
+/* fat12_unpack decodes FAT entries [first, first+count) from the
+   packed FAT starting at fat into table[first..first+count-1] */
+void fat12_unpack(const uint8_t *fat, uint16_t *table,
+		  uint32_t first, uint32_t count)
+{
+    if (unpack_pairs == NULL)
+	choose_kernels();
+    if (count == 0)
+	return;
+
+    /* ragged ends, one entry at a time */
+    if (first % 2)
+    {
+	table[first] = unpack_one(fat, first);
+	first++;
+	count--;
+    }
+    if (count % 2)
+    {
+	count--;
+	table[first + count] = unpack_one(fat, first + count);
+    }
+    unpack_pairs(fat, table, first, count);
+}
+
+
+/* fat12_pack encodes table[first..first+count-1] into the packed FAT
+   at fat, leaving the neighbouring entries untouched */
+void fat12_pack(uint8_t *fat, const uint16_t *table,
+		uint32_t first, uint32_t count)
+{
+    if (pack_pairs == NULL)
+	choose_kernels();
+    if (count == 0)
+	return;
+
+    if (first % 2)
+    {
+	pack_one(fat, first, table[first]);
+	first++;
+	count--;
+    }
+    if (count % 2)
+    {
+	count--;
+	pack_one(fat, first + count, table[first + count]);
+    }
+    pack_pairs(fat, table, first, count);
+}
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* The FAT as a graph: each cluster in use has at most one successor,
+   so the chains are paths that may run into each other (cross-links)
+   or back into themselves (loops), however damaged the image is.
+   build_fat_graph works all of that out in a few linear passes over
+   the decoded FAT, so whatever uses it never has to follow a chain
+   without knowing where it ends:
+
+   - next[] is each cluster's successor, with every loop broken at the
+     cluster whose successor closes it, so following next[] always
+     stops;
+   - end[] says why a chain stops where it does: an end of file
+     marker, or a link to a free or bad cluster, to a cluster number
+     that isn't on the disk, back to itself, or round a loop;
+   - indeg[] counts the chains running into each cluster.  Clusters
+     nothing runs into are the heads of the chains, and clusters more
+     than one chain runs into are where chains join.
+
+   Loops are broken where a walk from the lowest numbered head that
+   reaches them first meets its own trail, so the choice doesn't
+   depend on anything but the FAT.  A loop that nothing runs into is
+   entered at the first of starts (the clusters directory entries
+   point at) on it, if any, so a file whose chain is a loop keeps all
+   of it. */
+
+
+struct fat_graph *build_fat_graph(struct fat_volume *vol,
+				  const uint64_t *starts)
+{
+    struct fat_graph *g = malloc(sizeof(struct fat_graph));
+    uint32_t *mark, walk = 0, pass;
+    uint16_t c, v;
+    uint32_t n;
+
+    n = vol->nclusters;
+    if (n > vol->fat_nentries)
+	n = vol->fat_nentries;
+    if (n > vol->max_cluster)
+	n = vol->max_cluster;
+    memset(g, 0, sizeof(struct fat_graph));
+    g->n = n;
+    g->next = calloc(n, sizeof(uint16_t));
+    g->indeg = calloc(n, sizeof(uint16_t));
+    g->flags = calloc(n, 1);
+    g->end = calloc(n, 1);
+
+    /* what's in use, and where each cluster leads */
+    for (c = CLUST_FIRST; c < n; c++)
+    {
+	v = vol->fat[c];
+	if (v == (CLUST_FREE & FAT12_MASK) || v == (CLUST_BAD & FAT12_MASK))
+	    continue;
+	g->flags[c] = FG_USED;
+	g->nused++;
+    }
+    for (c = CLUST_FIRST; c < n; c++)
+    {
+	if (!(g->flags[c] & FG_USED))
+	    continue;
+	v = vol->fat[c];
+	if (v >= (CLUST_EOFS & FAT12_MASK))
+	    g->end[c] = FG_EOF;
+	else if (v < CLUST_FIRST || v >= n)
+	    g->end[c] = FG_RANGE;
+	else if (v == c)
+	    g->end[c] = FG_SELF;
+	else if (vol->fat[v] == (CLUST_FREE & FAT12_MASK))
+	    g->end[c] = FG_FREE;
+	else if (vol->fat[v] == (CLUST_BAD & FAT12_MASK))
+	    g->end[c] = FG_BAD;
+	else
+	{
+	    g->next[c] = v;
+	    g->indeg[v]++;
+	}
+    }
+
+    /* walk from every head, then every start, then everything else -
+       by then, only loops nothing runs into are left - marking each
+       cluster with the walk that got there first.  A walk that meets
+       its own trail has gone round a loop. */
+    mark = calloc(n, sizeof(uint32_t));
+    for (pass = 0; pass < 3; pass++)
+    {
+	for (c = CLUST_FIRST; c < n; c++)
+	{
+	    if (!(g->flags[c] & FG_USED) || mark[c] != 0)
+		continue;
+	    if (pass == 0 && g->indeg[c] != 0)
+		continue;
+	    if (pass == 1 && (starts == NULL ||
+			      !(starts[c / 64] & (1ULL << (c % 64)))))
+		continue;
+
+	    walk++;
+	    v = c;
+	    mark[v] = walk;
+	    while (g->next[v] != 0 && mark[g->next[v]] == 0)
+	    {
+		v = g->next[v];
+		mark[v] = walk;
+	    }
+	    if (g->next[v] != 0 && mark[g->next[v]] == walk)
+	    {
+		g->end[v] = FG_LOOP;
+		g->indeg[g->next[v]]--;
+		g->next[v] = 0;
+		g->nloops++;
+	    }
+	}
+    }
+    free(mark);
+
+    /* with the loops broken, every chain starts at a head */
+    for (c = CLUST_FIRST; c < n; c++)
+    {
+	if (!(g->flags[c] & FG_USED))
+	    continue;
+	if (g->indeg[c] == 0)
+	{
+	    g->flags[c] |= FG_HEAD;
+	    g->nheads++;
+	}
+	else if (g->indeg[c] > 1)
+	{
+	    g->flags[c] |= FG_JOIN;
+	    g->njoins++;
+	}
+    }
+    return g;
+}
+
+
+void free_fat_graph(struct fat_graph *g)
+{
+    free(g->next);
+    free(g->indeg);
+    free(g->flags);
+    free(g->end);
+    free(g);
+}
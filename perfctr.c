@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* Hardware performance counters around a few named regions of the
+   code - decoding the FAT, walking the directories, copying a file
+   in, scandisk's orphan search - for telling whether a change to a
+   kernel's layout or instructions actually helped on real hardware.
+   For each region, every call's cycles, instructions, last level
+   cache misses and branch mispredicts are added up, along with its
+   wall time and the bytes it worked on.
+
+   Nothing is counted until perf_enable is called; a region costs a
+   single test until then.  Setting DOS_PERF=<file> in the environment
+   enables counting in any of the tools, and saves the totals to the
+   file when it exits, which is how dos_bench gets them out of
+   scandisk.  Each thread opens its own group of counters with
+   perf_event_open the first time it enters a region.  Where that
+   isn't allowed (perf_event_paranoid, a container, a virtual machine
+   without a PMU, not Linux), the counters are reported as
+   unavailable, and the regions are timed all the same. */
+
+static const char *region_names[PERF_NREGIONS] = {
+    "fat_decode", "traverse", "copy_in", "findorphans"
+};
+
+static const char *counter_names[PERF_NCOUNTERS] = {
+    "cycles", "instructions", "llc_misses", "branch_misses"
+};
+
+struct region_totals {
+    uint64_t calls, ns, bytes;
+    uint64_t counts[PERF_NCOUNTERS];
+};
+
+static struct region_totals totals[PERF_NREGIONS];
+static int perf_on = FALSE;
+static int perf_have[PERF_NCOUNTERS]; /* counters some thread could open */
+static int perf_errno;                /* why one couldn't, if none could */
+static char *perf_save_file;
+
+static __thread int group_fd = -2;    /* -2 until opened, -1 if it can't be */
+static __thread int group_index[PERF_NCOUNTERS]; /* place in the group's
+						    read, or -1 */
+
+
+#ifdef __linux__
+static const uint64_t counter_configs[PERF_NCOUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/* open_group opens this thread's counters as one group, led by the
+   first one that opens, so they're all read at once.  Counters the
+   CPU doesn't have are left out. */
+static int open_group(void)
+{
+    struct perf_event_attr attr;
+    int leader = -1, fd, i, n = 0;
+
+    for (i = 0; i < PERF_NCOUNTERS; i++)
+    {
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = counter_configs[i];
+	attr.read_format = PERF_FORMAT_GROUP;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	fd = syscall(SYS_perf_event_open, &attr, 0, -1, leader, 0);
+	group_index[i] = -1;
+	if (fd < 0)
+	{
+	    __atomic_store_n(&perf_errno, errno, __ATOMIC_RELAXED);
+	    continue;
+	}
+	if (leader < 0)
+	    leader = fd;
+	group_index[i] = n++;
+	__atomic_store_n(&perf_have[i], TRUE, __ATOMIC_RELAXED);
+    }
+    return leader;
+}
+
+static void read_group(uint64_t *counts)
+{
+    uint64_t buf[1 + PERF_NCOUNTERS];
+    int i;
+
+    memset(counts, 0, PERF_NCOUNTERS * sizeof(uint64_t));
+    if (read(group_fd, buf, sizeof(buf)) <= 0)
+	return;
+    for (i = 0; i < PERF_NCOUNTERS; i++)
+	if (group_index[i] >= 0 && (uint64_t)group_index[i] < buf[0])
+	    counts[i] = buf[1 + group_index[i]];
+}
+#else
+static int open_group(void)
+{
+    perf_errno = ENOSYS;
+    return -1;
+}
+
+static void read_group(uint64_t *counts)
+{
+    memset(counts, 0, PERF_NCOUNTERS * sizeof(uint64_t));
+}
+#endif
+
+
+void perf_enable(void)
+{
+    perf_on = TRUE;
+}
+
+void perf_begin(struct perf_mark *m)
+{
+    m->on = perf_on;
+    if (!m->on)
+	return;
+    if (group_fd == -2)
+	group_fd = open_group();
+    if (group_fd >= 0)
+	read_group(m->counts);
+    m->ns = stats_now();
+}
+
+/* perf_end adds what happened since perf_begin to region's totals */
+void perf_end(int region, struct perf_mark *m, uint64_t bytes)
+{
+    struct region_totals *t = &totals[region];
+    uint64_t now[PERF_NCOUNTERS], ns;
+    int i;
+
+    if (!m->on)
+	return;
+    ns = stats_now() - m->ns;
+    if (group_fd >= 0)
+    {
+	read_group(now);
+	for (i = 0; i < PERF_NCOUNTERS; i++)
+	    __atomic_fetch_add(&t->counts[i], now[i] - m->counts[i],
+			       __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&t->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->ns, ns, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->bytes, bytes, __ATOMIC_RELAXED);
+}
+
+
+/* perf_save writes the totals out in a form perf_load reads back:
+   one line per region, with -1 for the counters that weren't
+   available */
+void perf_save(FILE *out)
+{
+    int r, i;
+
+    fprintf(out, "# region calls ns bytes");
+    for (i = 0; i < PERF_NCOUNTERS; i++)
+	fprintf(out, " %s", counter_names[i]);
+    fprintf(out, "\n");
+    for (r = 0; r < PERF_NREGIONS; r++)
+    {
+	fprintf(out, "%s %llu %llu %llu", region_names[r],
+		(unsigned long long)totals[r].calls,
+		(unsigned long long)totals[r].ns,
+		(unsigned long long)totals[r].bytes);
+	for (i = 0; i < PERF_NCOUNTERS; i++)
+	    fprintf(out, " %lld", perf_have[i] ? (long long)totals[r].counts[i] : -1LL);
+	fprintf(out, "\n");
+    }
+}
+
+/* perf_load adds the totals saved in filename (by another process)
+   to this one's.  Returns 0, or -1 if it can't be read. */
+int perf_load(char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    char line[512], name[64];
+    unsigned long long calls, ns, bytes;
+    long long c[PERF_NCOUNTERS];
+    int r, i;
+
+    if (f == NULL)
+	return -1;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+	if (sscanf(line, "%63s %llu %llu %llu %lld %lld %lld %lld", name,
+		   &calls, &ns, &bytes, &c[0], &c[1], &c[2], &c[3]) != 8)
+	    continue;
+	for (r = 0; r < PERF_NREGIONS; r++)
+	    if (strcmp(name, region_names[r]) == 0)
+		break;
+	if (r == PERF_NREGIONS)
+	    continue;
+	totals[r].calls += calls;
+	totals[r].ns += ns;
+	totals[r].bytes += bytes;
+	for (i = 0; i < PERF_NCOUNTERS; i++)
+	{
+	    if (c[i] < 0)
+		continue;
+	    perf_have[i] = TRUE;
+	    totals[r].counts[i] += c[i];
+	}
+    }
+    fclose(f);
+    return 0;
+}
+
+
+static void print_count(FILE *out, int have, uint64_t count, int width)
+{
+    if (have)
+	fprintf(out, " %*llu", width, (unsigned long long)count);
+    else
+	fprintf(out, " %*s", width, "n/a");
+}
+
+static void print_ratio(FILE *out, int have, double num, double den,
+			int width)
+{
+    if (have && den > 0)
+	fprintf(out, " %*.2f", width, num / den);
+    else
+	fprintf(out, " %*s", width, "n/a");
+}
+
+/* perf_print prints the totals for people, with instructions per
+   cycle and per byte worked on */
+void perf_print(FILE *out)
+{
+    struct region_totals *t;
+    int *have = perf_have;
+    int r;
+
+    if (!have[0] && !have[1] && !have[2] && !have[3])
+	fprintf(out, "hardware counters unavailable (%s): wall time only\n",
+		strerror(perf_errno ? perf_errno : ENOENT));
+
+    fprintf(out, "%-12s %7s %11s %12s %12s %6s %8s %10s %10s\n", "region",
+	    "calls", "ms", "cycles", "instructions", "IPC", "instr/B",
+	    "LLC miss", "br miss");
+    for (r = 0; r < PERF_NREGIONS; r++)
+    {
+	t = &totals[r];
+	if (t->calls == 0)
+	    continue;
+	fprintf(out, "%-12s %7llu %11.3f", region_names[r],
+		(unsigned long long)t->calls, t->ns / 1e6);
+	print_count(out, have[0], t->counts[0], 12);
+	print_count(out, have[1], t->counts[1], 12);
+	print_ratio(out, have[0] && have[1], t->counts[1], t->counts[0], 6);
+	print_ratio(out, have[1], t->counts[1], t->bytes, 8);
+	print_count(out, have[2], t->counts[2], 10);
+	print_count(out, have[3], t->counts[3], 10);
+	fprintf(out, "\n");
+    }
+}
+
+
+static void save_at_exit(void)
+{
+    FILE *f = fopen(perf_save_file, "w");
+
+    if (f == NULL)
+	return;
+    perf_save(f);
+    fclose(f);
+}
+
+/* DOS_PERF=<file> turns the counters on in any program, before main */
+__attribute__((constructor))
+static void perf_from_environment(void)
+{
+    char *file = getenv("DOS_PERF");
+
+    if (file == NULL || *file == '\0')
+	return;
+    perf_save_file = file;
+    perf_enable();
+    atexit(save_at_exit);
+}
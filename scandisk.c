@@ -8,6 +8,10 @@
 #include <sys/stat.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <strings.h>
+#include <time.h>
 
 #include "bootsect.h"
 #include "bpb.h"
@@ -15,172 +19,260 @@
 #include "fat.h"
 #include "dos.h"
 
-void write_dirent(struct direntry *dirent, char *filename, 
-		  uint16_t start_cluster, uint32_t size)
+void print_indent(int indent, FILE *out)
 {
-    char *p, *p2;
-    char *uppername;
-    int len, i;
+    int i;
+    for (i = 0; i < indent*4; i++)
+	fprintf(out, " ");
+}
 
-    /* clean out anything old that used to be here */
-    memset(dirent, 0, sizeof(struct direntry));
+//scandisk works in two phases.  The first only looks: it runs on a
+//read-only mapping of the image, and works out what's wrong and what
+//to do about it - the repair plan.  The second makes all the repairs
+//in the plan in one go, and syncs the image once at the end.  With
+//--dry-run, the plan is printed instead.
+#define FIX_FAT     1           //set fat[cluster] to value
+#define FIX_SIZE    2           //set the size of the file at dirent_off to size
+#define FIX_DELETE  3           //mark the entry at dirent_off deleted
+#define FIX_RECOVER 4           //make FOUND<value>.DAT in the root directory,
+                                //starting at cluster, size bytes long
+#define FIX_START   5           //set the start cluster of the file at dirent_off
+                                //to value
 
-    /* extract just the filename part */
-    uppername = strdup(filename);
-    p2 = uppername;
-    for (i = 0; i < strlen(filename); i++) 
-    {
-	if (p2[i] == '/' || p2[i] == '\\') 
-	{
-	    uppername = p2+i+1;
-	}
-    }
+struct repair {
+    uint32_t dirent_off;        //where the file's entry is in the image
+    int kind;
+    uint16_t cluster, value;
+    uint32_t size;
+};
 
-    /* convert filename to upper case */
-    for (i = 0; i < strlen(uppername); i++) 
-    {
-	uppername[i] = toupper(uppername[i]);
+struct repair_list {
+    struct repair *repairs;
+    int n, max;
+    struct fat_volume *vol;
+};
+
+void add_repair(struct repair_list *list, uint32_t dirent_off, int kind,
+                uint16_t cluster, uint16_t value, uint32_t size)
+{
+    if (list->n == list->max){
+        list->max = list->max ? list->max * 2 : 16;
+        list->repairs = realloc(list->repairs, list->max * sizeof(struct repair));
     }
+    struct repair *r = &list->repairs[list->n];
+    r->dirent_off = dirent_off;
+    r->kind = kind;
+    r->cluster = cluster;
+    r->value = value;
+    r->size = size;
+    list->n++;
+}
 
-    /* set the file name and extension */
-    memset(dirent->deName, ' ', 8);
-    p = strchr(uppername, '.');
-    memcpy(dirent->deExtension, "___", 3);
-    if (p == NULL) 
-    {
-	fprintf(stderr, "No filename extension given - defaulting to .___\n");
+//Who refers to which clusters.  Almost every cluster in use is referred
+//to exactly once, so all that takes is a bit per cluster; the few that
+//are referred to more than once (cross-links) go in a small hash table
+//on the side, with their counts.  That keeps scandisk's memory at about
+//a bit per cluster, however big the volume is.
+struct extra_ref {
+    uint16_t cluster;           //0 if the slot is empty
+    uint16_t count;
+};
+
+struct refs {
+    uint64_t *seen;             //one bit per cluster, set once it's referred to
+    struct extra_ref *extra;    //clusters referred to more than once
+    int nextra, maxextra;       //maxextra is a power of 2
+};
+
+void init_refs(struct refs *r, uint32_t nclusters){
+    r->seen = calloc((nclusters + 63) / 64, sizeof(uint64_t));
+    r->extra = NULL;
+    r->nextra = r->maxextra = 0;
+}
+
+void free_refs(struct refs *r){
+    free(r->seen);
+    free(r->extra);
+}
+
+//find cluster's slot in the extra table, or the empty slot it goes in
+struct extra_ref *extra_slot(struct refs *r, uint16_t cluster){
+    uint32_t i = (cluster * 2654435761u) & (r->maxextra - 1);
+    while (r->extra[i].cluster != 0 && r->extra[i].cluster != cluster)
+        i = (i + 1) & (r->maxextra - 1);
+    return &r->extra[i];
+}
+
+//add_ref counts one more reference to cluster, and returns how many
+//there were before
+int add_ref(struct refs *r, uint16_t cluster){
+    uint64_t bit = 1ULL << (cluster % 64);
+    if (!(r->seen[cluster / 64] & bit)){
+        r->seen[cluster / 64] |= bit;
+        return 0;
     }
-    else 
-    {
-	*p = '\0';
-	p++;
-	len = strlen(p);
-	if (len > 3) len = 3;
-	memcpy(dirent->deExtension, p, len);
+    if (4 * (r->nextra + 1) > 3 * r->maxextra){
+        //grow the table, and put everything back in it
+        struct extra_ref *old = r->extra;
+        int i, n = r->maxextra;
+        r->maxextra = n ? n * 2 : 16;
+        r->extra = calloc(r->maxextra, sizeof(struct extra_ref));
+        for (i = 0; i < n; i++)
+            if (old[i].cluster != 0)
+                *extra_slot(r, old[i].cluster) = old[i];
+        free(old);
     }
-
-    if (strlen(uppername)>8) 
-    {
-	uppername[8]='\0';
+    struct extra_ref *e = extra_slot(r, cluster);
+    if (e->cluster == 0){
+        e->cluster = cluster;
+        e->count = 1;
+        r->nextra++;
     }
-    memcpy(dirent->deName, uppername, strlen(uppername));
-    free(p2);
-
-    /* set the attributes and file size */
-    dirent->deAttributes = ATTR_NORMAL;
-    putushort(dirent->deStartCluster, start_cluster);
-    putulong(dirent->deFileSize, size);
+    if (e->count < 0xffff)
+        e->count++;
+    return e->count - 1;
+}
 
+int is_referenced(struct refs *r, uint16_t cluster){
+    return (r->seen[cluster / 64] >> (cluster % 64)) & 1;
 }
 
+//The FAT graph (see fatgraph.c) says where every chain goes and where
+//it stops, with loops already cut, so following a chain here always
+//ends.  Files claim their chains as they're listed, cluster by cluster:
+//a chain that runs into clusters someone listed earlier already has is
+//cross-linked, and gets cut off just before them.  Every cluster is
+//claimed at most once, so checking the whole volume is linear in its
+//size, however tangled the FAT is.
+struct listing {
+    struct fat_graph *graph;
+    struct refs *refs;          //who has claimed what
+    struct repair_list *plan;
+    struct fat_volume *vol;
+    FILE *out;                  //where the listing goes
+    int orphans;
+};
 
+//plan a FAT repair, and make it to the in-memory FAT too, so the
+//search for orphans sees the FAT as it will be once it's made
+void fix_fat(struct listing *l, uint32_t off, uint16_t cluster, uint16_t value,
+             const char *message){
+    if (message != NULL)
+        fprintf(l->out, "%s", message);
+    set_fat_entry(cluster, value, l->vol);
+    add_repair(l->plan, off, FIX_FAT, cluster, value, 0);
+}
 
-void create_dirent(struct direntry *dirent, char *filename, 
-		   uint16_t start_cluster, uint32_t size,
-		   uint8_t *image_buf, struct bpb33* bpb)
-{
-    while (1) 
-    {
-	if (dirent->deName[0] == SLOT_EMPTY) 
-	{
-	    /* we found an empty slot at the end of the directory */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    dirent++;
-
-	    /* make sure the next dirent is set to be empty, just in
-	       case it wasn't before */
-	    memset((uint8_t*)dirent, 0, sizeof(struct direntry));
-	    dirent->deName[0] = SLOT_EMPTY;
-	    printf("here1\n");
-	    return;
-	}
+//claim_chain claims the chain starting at start for the entry at off,
+//fixing wherever it stops badly, and returns how many clusters it has
+uint32_t claim_chain(struct listing *l, uint32_t off, uint16_t start, int quiet){
+    struct fat_graph *g = l->graph;
+    uint16_t cluster = start, previous = 0;
+    uint32_t length = 0;
 
-	if (dirent->deName[0] == SLOT_DELETED) 
-	{
-	    /* we found a deleted entry - we can just overwrite it */
-	    write_dirent(dirent, filename, start_cluster, size);
-	    printf("here2\n");
-	    return;
-	}
-	dirent++;
+    while (g->next[cluster] != 0 || length == 0){
+        if (length > 0){
+            previous = cluster;
+            cluster = g->next[cluster];
+        }
+        if (add_ref(l->refs, cluster)){
+            fix_fat(l, off, previous, FAT12_MASK & CLUST_EOFS, quiet ? NULL :
+                    "CROSS-LINKED!! Chain runs into another one - Setting FAT entry to EOF\n");
+            return length;
+        }
+        length++;
     }
-}
 
-void print_indent(int indent)
-{
-    int i;
-    for (i = 0; i < indent*4; i++)
-	printf(" ");
+    switch (g->end[cluster]){
+    case FG_SELF:
+        fix_fat(l, off, cluster, FAT12_MASK & CLUST_EOFS, quiet ? NULL :
+                "Pointing to itself - Setting FAT entry to EOF\n");
+        break;
+    case FG_LOOP:
+        fix_fat(l, off, cluster, FAT12_MASK & CLUST_EOFS, quiet ? NULL :
+                "LOOPS BACK!! Chain runs back into itself - Setting FAT entry to EOF\n");
+        break;
+    case FG_BAD:
+        fix_fat(l, off, cluster, FAT12_MASK & CLUST_EOFS, quiet ? NULL :
+                "BAD CLUSTER!! Set previous cluster to EOF\n");
+        break;
+    case FG_FREE:
+    case FG_RANGE:
+        fix_fat(l, off, cluster, FAT12_MASK & CLUST_EOFS, NULL);
+        break;
+    }
+    return length;
 }
 
 //A function to find a few errors that might be wrong with the files and their clusters
-//errors include: inconsistency problems, bad or free clusters being pointed to, and 
-//a cluster referencing itself (therefore creating an infinite chain).
-//The function will also fix all of these problems.
-void check_errors(struct direntry *dirent, uint8_t *image_buf, struct bpb33* bpb, int *refs, int size){
+//errors include: inconsistency problems, bad or free clusters being pointed to, a
+//chain looping back on itself, and chains that are cross-linked with each other.
+//Returns 0 if the entry is going away, so there's nothing to go into.
+int check_errors(struct direntry *dirent, int kind, struct listing *l){
+        struct fat_volume *vol = l->vol;
+        uint32_t size = getulong(dirent->deFileSize);
+        uint32_t off = (uint8_t*)dirent - vol->image_buf;
 				//keep track of the size of the FAT entry chain
-				int fat_chain = 0;
-        uint16_t next_cluster = getushort(dirent->deStartCluster);
-        //set original cluster
-        uint16_t orig_cluster = next_cluster;
-        uint16_t previous;
-        //go through chain, update the reference array, and find & fix errors
-        while(is_valid_cluster(next_cluster,bpb)){
-            refs[next_cluster]++;
-            uint16_t previous = next_cluster;
-            next_cluster = get_fat_entry(next_cluster,image_buf, bpb);
-        		if (previous==next_cluster){
-        			printf("Pointing to itself - Setting FAT entry to EOF\n");
-        			//mark as EOF and leave 
-        			set_fat_entry(next_cluster, FAT12_MASK & CLUST_EOFS,image_buf, bpb);
-        			fat_chain++;
-        			break;
-        		}
-        		if (next_cluster == (FAT12_MASK & CLUST_BAD)){
-        			printf("BAD CLUSTER!! Set previous cluster to EOF\n");
-        			//mark as end of file
-        			set_fat_entry(previous,FAT12_MASK & CLUST_EOFS,image_buf, bpb);
-        			break;
-        		}
-        		if (next_cluster == (FAT12_MASK & CLUST_FREE)){
-        			set_fat_entry(previous,FAT12_MASK & CLUST_EOFS,image_buf, bpb);
-        			break;
-        		}        		
-						fat_chain ++;
+				uint32_t fat_chain = 0;
+        uint16_t start = getushort(dirent->deStartCluster);
+
+        if (is_valid_cluster(start, vol) && start < l->graph->n){
+            if (is_referenced(l->refs, start)){
+                //someone else already has this chain - it's theirs
+                add_ref(l->refs, start);
+                fprintf(l->out, "Lotso refs - deleting the extra ones\n");
+                add_repair(l->plan, off, FIX_DELETE, 0, 0, 0);
+                return 0;
+            }
+            if (l->graph->flags[start] & FG_USED)
+                fat_chain = claim_chain(l, off, start, 0);
+            else if (get_fat_entry(start, vol) == (FAT12_MASK & CLUST_FREE)){
+                //the start of the file, with its FAT entry lost
+                add_ref(l->refs, start);
+                fix_fat(l, off, start, FAT12_MASK & CLUST_EOFS, NULL);
+                fat_chain = 1;
+            }
         }
-        
-        int getsize;
-        if (size%512 == 0)
-        	getsize = size/512;
-        else
-        	getsize= size/512 + 1;
+        //directories don't have a size
+        if (kind != 1)
+            return 1;
+
+        uint32_t getsize = (size + vol->bytes_per_cluster - 1) / vol->bytes_per_cluster;
         	
         //check for size inconsistencies between the size in the directory and the chain of FAT entries 
-        //and fix them when necessary
         
-        if (getsize< fat_chain){
-        			printf("CONSISTENCY PROBLEM!! file size is less than the cluster chain length\n");
-        			//need to free cluster and the chain of clusters after it
-        			next_cluster = get_fat_entry(orig_cluster+getsize-1, image_buf, bpb);
-        			while(is_valid_cluster(next_cluster,bpb)){
-        				previous = next_cluster;
-        				set_fat_entry(previous, FAT12_MASK & CLUST_FREE, image_buf, bpb);
-        				next_cluster = get_fat_entry(next_cluster, image_buf, bpb);
+        if (getsize < fat_chain && getsize > 0){
+        			//the file ends at its getsize'th cluster, and the rest of the
+        			//chain after that gets freed
+        			uint16_t last = start, next_cluster;
+        			for (uint32_t i = 1; i < getsize; i++)
+        				last = get_fat_entry(last, vol);
+        			next_cluster = get_fat_entry(last, vol);
+        			fix_fat(l, off, last, FAT12_MASK & CLUST_EOFS,
+        			        "CONSISTENCY PROBLEM!! file size is less than the cluster chain length\n");
+        			for (uint32_t i = getsize; i < fat_chain; i++){
+        				uint16_t cluster = next_cluster;
+        				next_cluster = get_fat_entry(cluster, vol);
+        				fix_fat(l, off, cluster, FAT12_MASK & CLUST_FREE, NULL);
         			}
-        			//set original cluster to end of file
-        			set_fat_entry(orig_cluster+getsize-1, FAT12_MASK & CLUST_EOFS, image_buf, bpb);
         }
         			
         if (getsize > fat_chain){
-        			printf("CONSISTENCY PROBLEM!! file size is greater than the cluster chain length\n");
-        			int new_size= fat_chain*512;
-        			putulong(dirent->deFileSize,new_size);
+        			fprintf(l->out, "CONSISTENCY PROBLEM!! file size is greater than the cluster chain length\n");
+        			add_repair(l->plan, off, FIX_SIZE, 0, 0, fat_chain*vol->bytes_per_cluster);
+        }
+
+        //no chain at all - an empty file doesn't get to point anywhere
+        if (fat_chain == 0 && start != 0){
+        			fprintf(l->out, "BAD START CLUSTER!! file has no chain - setting its start cluster to 0\n");
+        			add_repair(l->plan, off, FIX_START, 0, 0, 0);
         }
+        return 1;
 }
 
 //modify print_dirent 
 //only goes through directories, want it to print out for files
-uint16_t print_dirent(struct direntry *dirent, int indent, uint8_t *image_buf, struct bpb33* bpb, int *refs)
+uint16_t print_dirent(struct direntry *dirent, int indent, FILE *out)
 {
     uint16_t followclust = 0;
     int i;
@@ -236,7 +328,7 @@ uint16_t print_dirent(struct direntry *dirent, int indent, uint8_t *image_buf, s
     }
     else if ((dirent->deAttributes & ATTR_VOLUME) != 0) 
     {
-	      printf("Volume: %s\n", name);
+	      fprintf(out, "Volume: %s\n", name);
     } 
     else if ((dirent->deAttributes & ATTR_DIRECTORY) != 0) 
     {
@@ -244,8 +336,8 @@ uint16_t print_dirent(struct direntry *dirent, int indent, uint8_t *image_buf, s
         // for trash directories and such; just ignore them.
 	     if ((dirent->deAttributes & ATTR_HIDDEN) != ATTR_HIDDEN)
        {
-	        print_indent(indent);
-        	    printf("%s/ (directory)\n", name);
+	        print_indent(indent, out);
+        	    fprintf(out, "%s/ (directory)\n", name);
                 file_cluster = getushort(dirent->deStartCluster);
                 followclust = file_cluster;
        }
@@ -262,151 +354,728 @@ uint16_t print_dirent(struct direntry *dirent, int indent, uint8_t *image_buf, s
 	      int arch = (dirent->deAttributes & ATTR_ARCHIVE) == ATTR_ARCHIVE;
 
 	      size = getulong(dirent->deFileSize);
-	      print_indent(indent);
-	      printf("%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
+	      print_indent(indent, out);
+	      fprintf(out, "%s.%s (%u bytes) (starting cluster %d) %c%c%c%c\n", 
 	             name, extension, size, getushort(dirent->deStartCluster),
 	             ro?'r':' ', 
                hidden?'h':' ', 
                sys?'s':' ', 
                arch?'a':' ');
-        //added new function to check for any errors that could be fixed within the
-        //cluster chain of FAT entries       
-        check_errors(dirent, image_buf, bpb, refs, size);              
     }
 
     return followclust;
 }
 
 
-void follow_dir(uint16_t cluster, int indent, uint8_t *image_buf, struct bpb33* bpb, int *refs)
+//Before anything can be checked, scandisk reads every directory to find
+//where each entry's chain starts, which the FAT graph needs to know.
+//It's one pass over the directory clusters, on the calling thread,
+//keeping the directories still to read on a stack.  Each directory
+//cluster is only read once, even in an image where directories loop
+//back on themselves.
+#define MAX_THREADS 64
+
+struct scan {
+    struct fat_volume *vol;
+    uint64_t *starts;           //clusters entries start at
+    uint64_t visited[FREEMAP_WORDS]; //directory clusters already read
+    uint16_t *dirs;             //stack of directories still to read
+    int n, max;
+};
+
+//is this a file scandisk checks (1), a directory it goes into (2), or
+//neither (0)?  The same choices print_dirent makes.
+int entry_kind(struct direntry *dirent)
 {
-    while (is_valid_cluster(cluster, bpb))
-    {
-        struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
-
-        int numDirEntries = (bpb->bpbBytesPerSec * bpb->bpbSecPerClust) / sizeof(struct direntry);
-        int i = 0;
-	for ( ; i < numDirEntries; i++)
-	{
-            
-            uint16_t followclust = print_dirent(dirent, indent,image_buf,bpb,refs);
-            if (followclust){
-                refs[followclust]++;
-                follow_dir(followclust, indent+1, image_buf, bpb, refs);
-            }
-            dirent++;
-	}
+    uint8_t first = dirent->deName[0];
+    if (first == SLOT_EMPTY || first == SLOT_DELETED || first == 0x2E)
+        return 0;
+    if ((dirent->deAttributes & ATTR_WIN95LFN) == ATTR_WIN95LFN ||
+        (dirent->deAttributes & ATTR_VOLUME) != 0)
+        return 0;
+    if ((dirent->deAttributes & ATTR_DIRECTORY) != 0)
+        return (dirent->deAttributes & ATTR_HIDDEN) ? 0 : 2;
+    return 1;
+}
 
-	cluster = get_fat_entry(cluster, image_buf, bpb);
+void push_dir(struct scan *scan, uint16_t dir)
+{
+    if (scan->n == scan->max){
+        scan->max = scan->max ? scan->max * 2 : 64;
+        scan->dirs = realloc(scan->dirs, scan->max * sizeof(uint16_t));
     }
+    scan->dirs[scan->n++] = dir;
 }
 
+//note_start marks a cluster as the start of an entry's chain
+void note_start(struct scan *scan, uint16_t cluster)
+{
+    if (cluster < scan->vol->nclusters)
+        scan->starts[cluster / 64] |= 1ULL << (cluster % 64);
+}
 
-void traverse_root(uint8_t *image_buf, struct bpb33* bpb, int *refs)
+//check_dir reads everything in the directory starting at dir
+void check_dir(struct scan *scan, uint16_t dir)
 {
-    uint16_t cluster = 0;
+    struct fat_volume *vol = scan->vol;
+    uint16_t cluster = dir, sub;
+    struct direntry *dirent;
+    int i, n;
 
-    struct direntry *dirent = (struct direntry*)cluster_to_addr(cluster, image_buf, bpb);
+    while (1){
+        if (cluster == MSDOSFSROOT){
+            dirent = (struct direntry*)root_dir_addr(vol);
+            n = vol->bpb->bpbRootDirEnts;
+        } else {
+            if (!is_valid_cluster(cluster, vol) || cluster >= vol->nclusters)
+                return;
+            if (scan->visited[cluster / 64] & (1ULL << (cluster % 64)))
+                return;
+            scan->visited[cluster / 64] |= 1ULL << (cluster % 64);
+            dirent = (struct direntry*)cluster_to_addr(cluster, vol);
+            n = vol->bytes_per_cluster / sizeof(struct direntry);
+        }
 
-    int i = 0;
-    for ( ; i < bpb->bpbRootDirEnts; i++)
-    {
-        uint16_t followclust = print_dirent(dirent, 0, image_buf, bpb, refs);
-        if (is_valid_cluster(followclust, bpb)){
-            refs[followclust]++;
-            follow_dir(followclust, 1, image_buf, bpb, refs);
+        for (i = 0; i < n; i++, dirent++){
+            switch (entry_kind(dirent)){
+            case 1:
+                note_start(scan, getushort(dirent->deStartCluster));
+                break;
+            case 2:
+                sub = getushort(dirent->deStartCluster);
+                if (is_valid_cluster(sub, vol)){
+                    note_start(scan, sub);
+                    push_dir(scan, sub);
+                }
+                break;
+            }
         }
-        dirent++;
+
+        if (cluster == MSDOSFSROOT)
+            return;
+        cluster = get_fat_entry(cluster, vol);
     }
 }
 
+//check_volume reads every directory in the volume, and marks the
+//clusters their entries start at in starts, and the clusters the
+//directories themselves are in in dirmap
+void check_volume(struct fat_volume *vol, uint64_t *starts, uint64_t *dirmap)
+{
+    struct scan *scan = calloc(1, sizeof(struct scan));
+    STAT_START(t);
+
+    scan->vol = vol;
+    scan->starts = starts;
+    push_dir(scan, MSDOSFSROOT);
+    while (scan->n > 0)
+        check_dir(scan, scan->dirs[--scan->n]);
+
+    free(scan->dirs);
+    memcpy(dirmap, scan->visited, sizeof(scan->visited));
+    free(scan);
+    STAT_PHASE(STAT_TRAVERSE, t);
+}
+
+
+//the listing, with each file's problems found and reported as it's
+//listed.  Their repairs go on the plan, in listing order.
+uint16_t report_dirent(struct direntry *dirent, int indent, void *arg)
+{
+    struct listing *l = arg;
+    uint16_t followclust = print_dirent(dirent, indent, l->out);
+    int kind = entry_kind(dirent);
+
+    if (kind != 0 && !check_errors(dirent, kind, l))
+        return 0;
+    return followclust;
+}
 
 
 void usage(char *progname) {
-    fprintf(stderr, "usage: %s <imagename>\n", progname);
+    fprintf(stderr, "usage: %s [--dry-run] [--state <statefile>] [--stats[=json]] <imagename>\n", progname);
+    fprintf(stderr, "       %s [--dry-run] [-j <threads>] [--state <statedir>] [--stats[=json]] <imagename|directory>...\n", progname);
     exit(1);
 }
 
 //a function to create a new file in the directory for all of the orphans
 //creates the string for the filename and then puts it into the root directory
 
-void create_file(int orphans, int size, int i, uint8_t *image_buf, struct bpb33* bpb){
+void orphan_name(char *filename, int orphans){
 				char string[5];
 				sprintf(string, "%d", orphans);
-				char filename[1024]="";
-				strcat(filename, "found");
+				strcpy(filename, "found");
 				strcat(filename, string);
-				strcat(filename, ".dat\0");
+				strcat(filename, ".dat");
+}
+
+void create_file(int orphans, int size, int i, struct fat_volume *vol){
+				char filename[1024];
+				orphan_name(filename, orphans);
 				char *file = filename;
-				printf("New file to to the driectory add is: %s\n", filename);
-				printf("Orphan has a chain of %d clusters\n", size);
-				struct direntry *dirent = (struct direntry*)root_dir_addr(image_buf, bpb);
-				create_dirent(dirent, file, i, size*512, image_buf, bpb);
+				struct direntry *dirent = (struct direntry*)root_dir_addr(vol);
+				create_dirent(dirent, file, i, size, vol);
 }
 
 
-//a function to search for orphans (clusters that have no reference but are marked as bad or free)
-//and save them (aka add a new file to the directory and include its chain of FAT entries)
+//a function to search for orphans (clusters in use that nothing refers to)
+//and plan to save them (aka add a new file to the directory and include its chain of FAT entries).
+//Every orphaned chain starts at a head of the FAT graph nobody has claimed,
+//so that's all that needs looking at.
 
-void findorphans(int *refs, int numsec, uint8_t *image_buf, struct bpb33* bpb){
+void findorphans(struct listing *l){
+		struct fat_volume *vol = l->vol;
 		int orphans=0;
-		//go through the ref array and find any orphans
-		for(int i=2;i<numsec;i++){
-			uint16_t cluster = get_fat_entry(i,image_buf, bpb);
-			if (refs[i]==0 && cluster != (FAT12_MASK & CLUST_FREE) && cluster != (FAT12_MASK & CLUST_BAD)){ 
-				printf("Found orphan at: %d\n",i);
+		struct perf_mark pm;
+		perf_begin(&pm);
+		//the listing's repairs have changed the FAT
+		struct fat_graph *g = build_fat_graph(vol, NULL);
+		l->graph = g;
+		for(uint32_t i=2;i<g->n;i++){
+			if ((g->flags[i] & FG_HEAD) && !is_referenced(l->refs, i)){ 
+				fprintf(l->out, "Found orphan at: %d\n",i);
 				orphans++;
-				int size=1;
-				refs[i]=1;
-				uint16_t copy = cluster;
-				
-				while(is_valid_cluster(copy, bpb)){
-					copy= get_fat_entry(copy,image_buf, bpb);
-					refs[copy]++;
-          
-          if (refs[copy] > 1){
-          	  struct direntry *dirent = (struct direntry*)cluster_to_addr(copy,image_buf, bpb);
-		          //delete second entry that comes along if count will be greater than 1
-		          dirent->deName[0] = SLOT_DELETED;
-		          refs[copy] --;
-		          printf("\nLotso refs - deleting the extra ones\n");
-           }
-					size++;
-				}
-				create_file(orphans, size, i, image_buf, bpb);
+				int size = claim_chain(l, 0, i, 1);
+				char filename[1024];
+				orphan_name(filename, orphans);
+				fprintf(l->out, "New file to to the driectory add is: %s\n", filename);
+				fprintf(l->out, "Orphan has a chain of %d clusters\n", size);
+				add_repair(l->plan, 0, FIX_RECOVER, i, orphans, size*vol->bytes_per_cluster);
 			}
 		}
+		free_fat_graph(g);
+		l->orphans = orphans;
+		perf_end(PERF_FINDORPHANS, &pm, vol->fat_nentries * 3 / 2);
 		
-		printf("total orphan bebes: %d\n", orphans);
+		fprintf(l->out, "total orphan bebes: %d\n", orphans);
 }
 
-int main(int argc, char** argv) {
-    uint8_t *image_buf;
-    int fd;
-    struct bpb33* bpb;
-    if (argc < 2) {
-	usage(argv[0]);
+//print_plan says what apply_plan would do
+void print_plan(struct repair_list *plan, struct fat_volume *vol, FILE *out){
+    char name[MAXFILENAME];
+    int i;
+
+    if (plan->n == 0){
+        fprintf(out, "Nothing to repair\n");
+        return;
     }
+    fprintf(out, "Repair plan: %d changes\n", plan->n);
+    for (i = 0; i < plan->n; i++){
+        struct repair *r = &plan->repairs[i];
+        struct direntry *dirent = (struct direntry*)(vol->image_buf + r->dirent_off);
+        switch (r->kind){
+        case FIX_FAT:
+            fprintf(out, "    set FAT entry %d to 0x%03x\n", r->cluster, r->value);
+            break;
+        case FIX_SIZE:
+            get_dirent(dirent, name);
+            fprintf(out, "    set the size of %s to %u bytes\n", name, r->size);
+            break;
+        case FIX_DELETE:
+            fprintf(out, "    mark the entry at offset %u deleted\n", r->dirent_off);
+            break;
+        case FIX_START:
+            get_dirent(dirent, name);
+            fprintf(out, "    set the start cluster of %s to %d\n", name, r->value);
+            break;
+        case FIX_RECOVER:
+            orphan_name(name, r->value);
+            fprintf(out, "    recover the chain at cluster %d as %s (%u bytes)\n",
+                    r->cluster, name, r->size);
+            break;
+        }
+    }
+}
 
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
+//apply_plan makes all the repairs, in order, to a writable volume
+void apply_plan(struct repair_list *plan, struct fat_volume *vol){
+    int i;
+    STAT_START(t);
 
-    // your code should start here...
-    
-    int numsec= bpb->bpbSectors;
-    int *refs = malloc(sizeof(int)*bpb->bpbSectors);
-    //initialize all reference counts to 0
-    for(int i = 0; i<bpb->bpbSectors; i++){
-      refs[i]=0;
+    for (i = 0; i < plan->n; i++){
+        struct repair *r = &plan->repairs[i];
+        struct direntry *dirent = (struct direntry*)(vol->image_buf + r->dirent_off);
+        switch (r->kind){
+        case FIX_FAT:
+            set_fat_entry(r->cluster, r->value, vol);
+            break;
+        case FIX_SIZE:
+            putulong(dirent->deFileSize, r->size);
+            dir_written(dirent, vol);
+            break;
+        case FIX_DELETE:
+            dirent->deName[0] = SLOT_DELETED;
+            dir_written(dirent, vol);
+            break;
+        case FIX_START:
+            putushort(dirent->deStartCluster, r->value);
+            dir_written(dirent, vol);
+            break;
+        case FIX_RECOVER:
+            create_file(r->value, r->size, r->cluster, vol);
+            break;
+        }
     }
+    //the one and only sync
+    sync_volume(vol);
+    STAT_PHASE(STAT_REPAIR, t);
+}
+
+//--state keeps a state file for the image: a hash of each sector of the
+//FAT and of each directory cluster, and what the check found.  If the
+//last check found nothing wrong, and none of those has changed since,
+//nothing else can have either - every chain is in the FAT, and every
+//entry pointing at one is in a directory - so the next check just lists
+//the volume and reuses the verdict.  Otherwise it checks everything, and
+//says what changed.  Nightly checks of images that mostly don't change
+//skip nearly all the work that way.
+#define STATE_MAGIC "FATSCAN1"
+
+struct state_header {
+    char magic[8];
+    uint64_t boot;              //hash of the boot sector
+    uint32_t size;              //of the image
+    uint32_t nfat;              //FAT sector hashes that follow
+    uint32_t ndirs;             //then directory cluster hashes
+    uint32_t clean;             //the check found nothing to repair
+    uint32_t nused, nchains;    //for --dry-run's summary
+};
+
+struct state_dir {
+    uint16_t cluster;           //MSDOSFSROOT for the root directory
+    uint16_t pad[3];
+    uint64_t hash;
+};
+
+uint64_t boot_hash(struct fat_volume *vol){
+    return hash64(0, vol->image_buf, vol->bpb->bpbBytesPerSec);
+}
+
+uint64_t fat_sector_hash(uint32_t sector, struct fat_volume *vol){
+    uint32_t bps = vol->bpb->bpbBytesPerSec;
+    return hash64(sector, vol->image_buf + vol->fat_offset + sector * bps, bps);
+}
+
+uint64_t dir_cluster_hash(uint16_t cluster, struct fat_volume *vol){
+    if (cluster == MSDOSFSROOT)
+        return hash64(cluster, root_dir_addr(vol),
+                      vol->bpb->bpbRootDirEnts * sizeof(struct direntry));
+    return hash64(cluster, cluster_to_addr(cluster, vol), vol->bytes_per_cluster);
+}
+
+//read_state returns the state file's contents if it's for this image,
+//or NULL
+struct state_header *read_state(char *filename, struct fat_volume *vol){
+    struct state_header *st;
+    struct stat sb;
+    int fd = open(filename, O_RDONLY);
+
+    if (fd < 0)
+        return NULL;
+    st = NULL;
+    if (fstat(fd, &sb) == 0 && sb.st_size >= sizeof(struct state_header)){
+        st = malloc(sb.st_size);
+        if (read(fd, st, sb.st_size) != sb.st_size ||
+            memcmp(st->magic, STATE_MAGIC, 8) != 0 ||
+            sb.st_size != sizeof(struct state_header) + st->nfat * sizeof(uint64_t) +
+                          (uint64_t)st->ndirs * sizeof(struct state_dir) ||
+            st->boot != boot_hash(vol) || st->size != vol->size ||
+            st->nfat != vol->bpb->bpbFATsecs){
+            free(st);
+            st = NULL;
+        }
+    }
+    close(fd);
+    return st;
+}
+
+//state_unchanged says whether everything the state file hashed is the
+//same as it was after a clean check, counting what isn't
+int state_unchanged(struct state_header *st, struct fat_volume *vol,
+                    uint32_t *nfat, uint32_t *ndirs){
+    uint64_t *fat = (uint64_t*)(st + 1);
+    struct state_dir *dirs = (struct state_dir*)(fat + st->nfat);
+    uint32_t i;
+
+    *nfat = *ndirs = 0;
+    for (i = 0; i < st->nfat; i++)
+        if (fat[i] != fat_sector_hash(i, vol))
+            (*nfat)++;
+    for (i = 0; i < st->ndirs; i++)
+        if ((dirs[i].cluster != MSDOSFSROOT &&
+             (!is_valid_cluster(dirs[i].cluster, vol) || dirs[i].cluster >= vol->nclusters)) ||
+            dirs[i].hash != dir_cluster_hash(dirs[i].cluster, vol))
+            (*ndirs)++;
+    return *nfat == 0 && *ndirs == 0 && st->clean;
+}
+
+//write_state records the image's hashes and the verdict, for next time
+void write_state(char *filename, struct fat_volume *vol, uint64_t *dirmap,
+                 int clean, struct fat_graph *g){
+    struct state_header st;
+    struct state_dir dir;
+    uint32_t i;
+    char *tmpname;
+    FILE *f;
+    int ok;
+
+    memset(&st, 0, sizeof(st));
+    memcpy(st.magic, STATE_MAGIC, 8);
+    st.boot = boot_hash(vol);
+    st.size = vol->size;
+    st.nfat = vol->bpb->bpbFATsecs;
+    st.clean = clean;
+    st.nused = g->nused;
+    st.nchains = g->nheads;
+    //the root directory, then every cluster of every other one
+    st.ndirs = 1;
+    for (i = CLUST_FIRST; i < vol->nclusters; i++)
+        if (dirmap[i / 64] & (1ULL << (i % 64)))
+            st.ndirs++;
+
+    //write it alongside, then swap it in, like the catalog
+    tmpname = malloc(strlen(filename) + 16);
+    sprintf(tmpname, "%s.%d", filename, (int)getpid());
+    f = fopen(tmpname, "w");
+    ok = f != NULL && fwrite(&st, sizeof(st), 1, f) == 1;
+    for (i = 0; ok && i < st.nfat; i++){
+        uint64_t h = fat_sector_hash(i, vol);
+        ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    }
+    memset(&dir, 0, sizeof(dir));
+    dir.cluster = MSDOSFSROOT;
+    dir.hash = dir_cluster_hash(MSDOSFSROOT, vol);
+    ok = ok && fwrite(&dir, sizeof(dir), 1, f) == 1;
+    for (i = CLUST_FIRST; ok && i < vol->nclusters; i++){
+        if (!(dirmap[i / 64] & (1ULL << (i % 64))))
+            continue;
+        dir.cluster = i;
+        dir.hash = dir_cluster_hash(i, vol);
+        ok = fwrite(&dir, sizeof(dir), 1, f) == 1;
+    }
+    if (f != NULL && fclose(f) != 0)
+        ok = 0;
+    ok = ok && rename(tmpname, filename) == 0;
+    if (!ok){
+        fprintf(stderr, "Can't write state file %s: %s\n", filename, strerror(errno));
+        unlink(tmpname);
+    }
+    free(tmpname);
+}
+
+//just the listing, for when the check doesn't need doing again
+uint16_t list_dirent(struct direntry *dirent, int indent, void *arg)
+{
+    return print_dirent(dirent, indent, arg);
+}
+
+
+//What checking one image came to.  check_image does everything for one
+//image, writing its listing to out, and keeps no state of its own
+//outside the image's volume, so several can run at once.
+#define IMAGE_CLEAN    0        //nothing wrong
+#define IMAGE_REPAIRED 1        //repaired
+#define IMAGE_BROKEN   2        //needs repairing (with --dry-run)
+#define IMAGE_ERROR    3        //couldn't be checked
+
+struct image_result {
+    int status;
+    int reused;                 //the state file said nothing had changed
+    uint32_t fat_changed, dirs_changed; //what had, if there was a state file
+    uint32_t nused, nchains, ncross, nloops;
+    int nextra;                 //clusters referred to more than once
+    int orphans;
+    int repairs;
+    double ms;                  //how long it all took
+};
+
+int check_image(char *filename, char *state_file, int dry_run, FILE *out,
+                struct image_result *res){
+    struct fat_volume *vol;
+
+    memset(res, 0, sizeof(*res));
+    //the analysis never writes to the image
+    vol = open_volume_readonly(filename);
+    if (vol == NULL){
+        res->status = IMAGE_ERROR;
+        return -1;
+    }
+
+    struct state_header *st = state_file ? read_state(state_file, vol) : NULL;
+    if (st != NULL && state_unchanged(st, vol, &res->fat_changed, &res->dirs_changed)){
+	//nothing's changed since a clean check
+	walk_dirs(MSDOSFSROOT, 0, list_dirent, out, vol);
+	if (dry_run)
+	    fprintf(out, "FAT: %u clusters in use, %u chains, 0 cross-links, 0 loops\n",
+		    st->nused, st->nchains);
+	fprintf(out, "total orphan bebes: 0\n");
+	if (dry_run)
+	    fprintf(out, "0 clusters referred to more than once\nNothing to repair\n");
+	res->reused = 1;
+	res->nused = st->nused;
+	res->nchains = st->nchains;
+	free(st);
+	close_volume(vol);
+	return 0;
+    }
+    free(st);
+
+    struct refs refs;
+    init_refs(&refs, vol->nclusters);
+    uint64_t *starts = calloc(FREEMAP_WORDS, sizeof(uint64_t));
+    uint64_t *dirmap = calloc(FREEMAP_WORDS, sizeof(uint64_t));
     
-    image_buf = mmap_file(argv[1], &fd);
-    bpb = check_bootsector(image_buf);
-    //go through each cluster in the directory and their chains and then find possible size errors 
-    traverse_root(image_buf, bpb, refs);
-    //find and fix all orphans
-    findorphans(refs, numsec, image_buf, bpb);
-
-    unmmap_file(image_buf, &fd);
+    //find where everything in the directories starts
+    check_volume(vol, starts, dirmap);
+    //then work out the chains, and list everything, reporting the errors as we go
+    struct fat_graph *g = build_fat_graph(vol, starts);
+    struct repair_list plan = { NULL, 0, 0, vol };
+    struct listing listing = { g, &refs, &plan, vol, out, 0 };
+    walk_dirs(MSDOSFSROOT, 0, report_dirent, &listing, vol);
+    if (dry_run)
+	fprintf(out, "FAT: %u clusters in use, %u chains, %u cross-links, %u loops\n",
+		g->nused, g->nheads, g->njoins, g->nloops);
+    free(starts);
+    //find all orphans
+    findorphans(&listing);
+    if (dry_run)
+	fprintf(out, "%d clusters referred to more than once\n", refs.nextra);
+    if (state_file != NULL)
+	write_state(state_file, vol, dirmap, plan.n == 0, g);
+    res->nused = g->nused;
+    res->nchains = g->nheads;
+    res->ncross = g->njoins;
+    res->nloops = g->nloops;
+    res->nextra = refs.nextra;
+    res->orphans = listing.orphans;
+    res->repairs = plan.n;
+    free_refs(&refs);
+    free_fat_graph(g);
+    free(dirmap);
+
+    if (dry_run)
+	print_plan(&plan, vol, out);
+    close_volume(vol);
+
+    res->status = plan.n == 0 ? IMAGE_CLEAN : dry_run ? IMAGE_BROKEN : IMAGE_REPAIRED;
+    //and now fix everything
+    if (!dry_run && plan.n > 0) {
+	vol = open_volume(filename);
+	if (vol == NULL){
+	    res->status = IMAGE_ERROR;
+	    free(plan.repairs);
+	    return -1;
+	}
+	apply_plan(&plan, vol);
+	close_volume(vol);
+    }
+    free(plan.repairs);
     return 0;
 }
+
+
+//Given more than one image, or a directory of them, scandisk checks
+//them all at once on a pool of -j threads, one image per thread at a
+//time, and instead of the listings prints one report on the lot, in
+//JSON.  With --state, the argument is a directory to keep a state file
+//for each image in.
+struct fleet {
+    char **images;
+    int nimages;
+    int next;                   //the next image nobody's taken
+    int dry_run;
+    char *state_dir;
+    struct image_result *results;
+};
+
+double now_ms(void){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+//the state file for an image in the fleet: its path, with the slashes
+//turned into underscores, in the state directory
+char *fleet_state_file(struct fleet *f, char *image){
+    char *path = malloc(strlen(f->state_dir) + strlen(image) + 8);
+    char *p;
+    sprintf(path, "%s/", f->state_dir);
+    p = path + strlen(path);
+    strcpy(p, image);
+    for ( ; *p; p++)
+        if (*p == '/')
+            *p = '_';
+    strcat(path, ".scan");
+    return path;
+}
+
+void *fleet_thread(void *arg){
+    struct fleet *f = arg;
+    FILE *out = fopen("/dev/null", "w");
+    int i;
+
+    while ((i = __atomic_fetch_add(&f->next, 1, __ATOMIC_RELAXED)) < f->nimages){
+        char *state_file = f->state_dir ? fleet_state_file(f, f->images[i]) : NULL;
+        double start = now_ms();
+        check_image(f->images[i], state_file, f->dry_run, out, &f->results[i]);
+        f->results[i].ms = now_ms() - start;
+        free(state_file);
+    }
+    fclose(out);
+    stats_merge();
+    return NULL;
+}
+
+//json_string writes s as a JSON string
+void json_string(FILE *out, const char *s){
+    fputc('"', out);
+    for ( ; *s; s++){
+        if (*s == '"' || *s == '\\')
+            fprintf(out, "\\%c", *s);
+        else if ((unsigned char)*s < 0x20)
+            fprintf(out, "\\u%04x", *s);
+        else
+            fputc(*s, out);
+    }
+    fputc('"', out);
+}
+
+void fleet_report(struct fleet *f, int nthreads, double ms){
+    static const char *status[] = { "clean", "repaired", "broken", "error" };
+    int counts[4] = { 0, 0, 0, 0 };
+    int i;
+
+    printf("{\"threads\": %d, \"images\": [\n", nthreads);
+    for (i = 0; i < f->nimages; i++){
+        struct image_result *r = &f->results[i];
+        counts[r->status]++;
+        printf("  {\"image\": ");
+        json_string(stdout, f->images[i]);
+        printf(", \"status\": \"%s\", \"reused\": %s, \"ms\": %.3f", status[r->status],
+               r->reused ? "true" : "false", r->ms);
+        if (r->status != IMAGE_ERROR)
+            printf(", \"clusters_in_use\": %u, \"chains\": %u, \"cross_links\": %u, "
+                   "\"loops\": %u, \"multiply_referenced\": %d, \"orphans\": %d, "
+                   "\"repairs\": %d, \"fat_sectors_changed\": %u, \"dir_clusters_changed\": %u",
+                   r->nused, r->nchains, r->ncross, r->nloops, r->nextra, r->orphans,
+                   r->repairs, r->fat_changed, r->dirs_changed);
+        printf("}%s\n", i + 1 < f->nimages ? "," : "");
+    }
+    printf("], \"summary\": {\"images\": %d, \"clean\": %d, \"repaired\": %d, "
+           "\"broken\": %d, \"errors\": %d, \"ms\": %.3f}}\n",
+           f->nimages, counts[IMAGE_CLEAN], counts[IMAGE_REPAIRED],
+           counts[IMAGE_BROKEN], counts[IMAGE_ERROR], ms);
+}
+
+int cmp_name(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+//add_images adds path to the list of images, or if it's a directory,
+//every .img file in it, in name order
+void add_images(struct fleet *f, char *path){
+    struct stat sb;
+    struct dirent *d;
+    DIR *dir;
+    int first = f->nimages;
+
+    if (stat(path, &sb) != 0 || !S_ISDIR(sb.st_mode)){
+        f->images = realloc(f->images, (f->nimages + 1) * sizeof(char *));
+        f->images[f->nimages++] = strdup(path);
+        return;
+    }
+    dir = opendir(path);
+    if (dir == NULL){
+        fprintf(stderr, "Can't read directory %s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    while ((d = readdir(dir)) != NULL){
+        size_t len = strlen(d->d_name);
+        if (len <= 4 || strcasecmp(d->d_name + len - 4, ".img") != 0)
+            continue;
+        f->images = realloc(f->images, (f->nimages + 1) * sizeof(char *));
+        f->images[f->nimages] = malloc(strlen(path) + len + 2);
+        sprintf(f->images[f->nimages++], "%s/%s", path, d->d_name);
+    }
+    closedir(dir);
+    qsort(f->images + first, f->nimages - first, sizeof(char *), cmp_name);
+}
+
+//check_fleet checks all the images, and reports on them.  Returns
+//how many couldn't be checked.
+int check_fleet(struct fleet *f, int nthreads){
+    pthread_t threads[MAX_THREADS];
+    double start = now_ms();
+    int i, errors = 0;
+
+    //the FAT kernels are picked the first time they're used
+    fat12_kernel_name();
+    f->results = calloc(f->nimages, sizeof(struct image_result));
+    if (nthreads > f->nimages)
+        nthreads = f->nimages > 0 ? f->nimages : 1;
+    for (i = 1; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, fleet_thread, f);
+    fleet_thread(f);
+    for (i = 1; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    fleet_report(f, nthreads, now_ms() - start);
+    for (i = 0; i < f->nimages; i++)
+        if (f->results[i].status == IMAGE_ERROR)
+            errors++;
+    free(f->results);
+    return errors;
+}
+
+
+int main(int argc, char** argv) {
+    struct image_result res;
+    struct fleet fleet;
+    int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int dry_run = 0;
+    char *state_file = NULL;
+    int arg = 1;
+    stats_option(&argc, argv);
+    while (arg < argc && argv[arg][0] == '-') {
+	if (strcmp(argv[arg], "--dry-run") == 0)
+	    dry_run = 1;
+	else if (strcmp(argv[arg], "-j") == 0 && arg + 1 < argc)
+	    nthreads = atoi(argv[++arg]);
+	else if (strcmp(argv[arg], "--state") == 0 && arg + 1 < argc)
+	    state_file = argv[++arg];
+	else
+	    usage(argv[0]);
+	arg++;
+    }
+    if (arg >= argc || nthreads < 1) {
+	usage(argv[0]);
+    }
+    if (nthreads > MAX_THREADS)
+	nthreads = MAX_THREADS;
+
+    memset(&fleet, 0, sizeof(fleet));
+    int nargs = argc - arg;
+    for ( ; arg < argc; arg++)
+	add_images(&fleet, argv[arg]);
+
+    //just the one image: its listing, as always
+    if (nargs == 1 && fleet.nimages == 1 &&
+	strcmp(fleet.images[0], argv[argc - 1]) == 0) {
+	if (check_image(fleet.images[0], state_file, dry_run, stdout, &res) < 0)
+	    exit(1);
+	if (res.fat_changed || res.dirs_changed)
+	    fprintf(stderr, "%u FAT sectors and %u directory clusters changed since the last check\n",
+		    res.fat_changed, res.dirs_changed);
+	free(fleet.images[0]);
+	free(fleet.images);
+	return 0;
+    }
+
+    fleet.dry_run = dry_run;
+    fleet.state_dir = state_file;
+    int errors = check_fleet(&fleet, nthreads);
+    for (int i = 0; i < fleet.nimages; i++)
+	free(fleet.images[i]);
+    free(fleet.images);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "bootsect.h"
+#include "bpb.h"
+#include "direntry.h"
+#include "fat.h"
+#include "dos.h"
+
+
+/* Counters on the hot paths, and --stats to print them when a tool
+   exits.  Built with DOS_STATS, each thread counts into its own
+   struct dos_stats with plain adds, and adds them to the process's
+   totals (stats_merge) when it's done, so the counters cost next to
+   nothing and never contend.  Built without it, STAT_ADD and friends
+   compile to nothing, and --stats just says so. */
+
+#define STATS_OFF  0
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+#ifdef DOS_STATS
+__thread struct dos_stats thread_stats;
+#endif
+
+static struct dos_stats total_stats;
+static int stats_mode = STATS_OFF;
+
+static const char *phase_names[STAT_NPHASES] = {
+    "map", "boot_check", "traverse", "repair"
+};
+
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* stats_merge adds the calling thread's counters to the totals; a
+   thread that counted anything calls it before it finishes */
+void stats_merge(void)
+{
+#ifdef DOS_STATS
+    uint64_t *from = (uint64_t *)&thread_stats;
+    uint64_t *to = (uint64_t *)&total_stats;
+    size_t i;
+
+    for (i = 0; i < sizeof(struct dos_stats) / sizeof(uint64_t); i++)
+	__atomic_fetch_add(&to[i], from[i], __ATOMIC_RELAXED);
+    memset(&thread_stats, 0, sizeof(thread_stats));
+#endif
+}
+
+
+static void stats_report(void)
+{
+    struct dos_stats *s = &total_stats;
+    struct rusage ru;
+    int p;
+
+    fflush(stdout);             /* so the stats come after the output */
+    stats_merge();
+    getrusage(RUSAGE_SELF, &ru);
+
+    if (stats_mode == STATS_JSON)
+    {
+	fprintf(stderr, "{\"fat_reads\": %llu, \"fat_writes\": %llu, "
+		"\"clusters_touched\": %llu, \"dirents_scanned\": %llu, "
+		"\"bytes_copied\": %llu, \"minor_faults\": %ld, "
+		"\"major_faults\": %ld, \"phase_ms\": {",
+		(unsigned long long)s->fat_reads,
+		(unsigned long long)s->fat_writes,
+		(unsigned long long)s->clusters,
+		(unsigned long long)s->dirents,
+		(unsigned long long)s->bytes_copied,
+		ru.ru_minflt, ru.ru_majflt);
+	for (p = 0; p < STAT_NPHASES; p++)
+	    fprintf(stderr, "%s\"%s\": %.3f", p ? ", " : "", phase_names[p],
+		    s->phase_ns[p] / 1e6);
+	fprintf(stderr, "}}\n");
+	return;
+    }
+
+    fprintf(stderr, "stats: %llu FAT reads, %llu FAT writes, %llu clusters touched\n",
+	    (unsigned long long)s->fat_reads,
+	    (unsigned long long)s->fat_writes,
+	    (unsigned long long)s->clusters);
+    fprintf(stderr, "stats: %llu directory entries scanned, %llu bytes copied\n",
+	    (unsigned long long)s->dirents,
+	    (unsigned long long)s->bytes_copied);
+    fprintf(stderr, "stats: %ld minor and %ld major page faults\n",
+	    ru.ru_minflt, ru.ru_majflt);
+    fprintf(stderr, "stats:");
+    for (p = 0; p < STAT_NPHASES; p++)
+	fprintf(stderr, " %s %.3fms%s", phase_names[p], s->phase_ns[p] / 1e6,
+		p < STAT_NPHASES - 1 ? "," : "\n");
+}
+
+
+/* stats_option takes --stats or --stats=json out of argv, wherever
+   it is, and arranges for the counters to be printed (on stderr) when
+   the program exits.  Returns TRUE if it was there. */
+int stats_option(int *argc, char **argv)
+{
+    int i, j, found = FALSE;
+
+    for (i = 1; i < *argc; i++)
+    {
+	if (strcmp(argv[i], "--stats") == 0)
+	    stats_mode = STATS_TEXT;
+	else if (strcmp(argv[i], "--stats=json") == 0)
+	    stats_mode = STATS_JSON;
+	else
+	    continue;
+
+	for (j = i; j < *argc; j++)
+	    argv[j] = argv[j + 1];
+	(*argc)--;
+	i--;
+	found = TRUE;
+    }
+    if (!found)
+	return FALSE;
+
+#ifdef DOS_STATS
+    atexit(stats_report);
+#else
+    fprintf(stderr, "--stats: built without DOS_STATS (make STATS=1), so there is nothing to count\n");
+    (void)stats_report;
+#endif
+    return TRUE;
+}
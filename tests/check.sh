@@ -0,0 +1,37 @@
+#!/bin/sh
+# regression checks, run by `make check` from the top of the tree.
+# Each check works on a copy of goodimage.img, patched as it needs.
+
+tmp=$(mktemp -d /tmp/dos_check.XXXXXX) || exit 1
+trap 'rm -rf "$tmp"' EXIT
+failed=0
+
+fail()
+{
+    echo "FAIL: $*"
+    failed=1
+}
+
+# patch <image> <offset> <byte>... writes the bytes at offset
+patch()
+{
+    img=$1 off=$2
+    shift 2
+    printf "$(printf '\\%03o' "$@")" |
+	dd of="$img" bs=1 seek="$off" conv=notrunc 2>/dev/null
+}
+
+# a directory whose start cluster is way past the end of the FAT
+# (SRC's entry is at 0x2640, in the root directory)
+cp goodimage.img "$tmp/oob.img"
+patch "$tmp/oob.img" $((0x2640 + 26)) 0x00 0xf0
+./dos_cat "$tmp/oob.img" /SRC/DOS.H >/dev/null 2>&1
+[ $? -lt 128 ] || fail "dos_cat crashed on a bad directory start cluster"
+./dos_ls "$tmp/oob.img" >/dev/null 2>&1
+[ $? -lt 128 ] || fail "dos_ls crashed on a bad directory start cluster"
+./dos_cat goodimage.img /IMG/WHITNEY.JPG >"$tmp/whitney.jpg" 2>/dev/null
+./dos_cat "$tmp/oob.img" /IMG/WHITNEY.JPG 2>/dev/null | cmp -s - "$tmp/whitney.jpg" ||
+    fail "a bad directory broke lookups in the rest of the image"
+
+[ $failed -eq 0 ] && echo "all checks passed"
+exit $failed